@@ -5,6 +5,7 @@
  */
 
 #include "sample_test.h"
+#include "data_freeze.h"
 
 /**
  * @brief Add a new named data element to the global array.
@@ -16,81 +17,98 @@
  */
 bool append_data_element(const char * name, void * data) {
     bool status = false;
-    named_data_t *new_element = NULL;
+    named_data_t new_element = {0};
+    named_data_t * node = NULL;
+    data_shard_t * shard;
+    data_slot_t * new_segment = NULL;
+    size_t segment = 0;
 
     if (NULL == name || NULL == data) {
         /* Bad args! */
         goto done;
     }
 
-    /* Allocate a new struct to put on our array. */
-    new_element = malloc(sizeof(named_data_t));
-    if (NULL == new_element) {
-        /* Out of memory! */
+    if (data_array_frozen()) {
+        /* No appends until the array is unfrozen! */
         goto done;
     }
 
-    /* We don't own the name, so let's duplicate it. */
-    new_element->name = strdup(name);
-    if (NULL == new_element->name) {
+    /* We don't own the name, so let's copy it. */
+    if (false == set_data_element_name(&new_element, name)) {
         /* Out of memory! */
         goto done;
     }
 
     /* We're given ownership of the data, so we'll assign the pointer. */
-    new_element->data = data;
+    new_element.data = data;
 
-    /* Lock the array so we can safely add our new element. */
-    pthread_mutex_lock(&data_array_lock);
+    /* The array may keep our element in memory of its own. We allocate it before locking anything. */
+    if (false == alloc_data_node(&node)) {
+        /* Out of memory! */
+        goto done;
+    }
 
-    /*
-     * Append our data element to the end of the array.
-     */
-    if (NULL == g_data_array) {
-        /* Array doesn't exist, let's allocate it */
+    /* Elements with the same name always go in the same shard. */
+    shard = data_array_shard(new_element.name_hash);
+
+    /* If the shard has room, we may not have to lock it at all. */
+    if (true == try_store_data_element(shard, &new_element, node, NULL)) {
+        /* Success! */
+        status = true;
+        goto done;
+    }
 
-        g_data_array = malloc(ARRAY_BLK_SZ * sizeof(named_data_t*));
-        if (NULL == g_data_array) {
-            /* Failed to allocate memory for data array! */
-            goto unlock;
+    if (data_shard_full(shard)) {
+        /*
+         * Shard is full, make a new segment. Elements already in the shard
+         * never move. We allocate it before locking the shard, so that other
+         * appenders don't wait on the allocator.
+         */
+        segment = data_shard_next_segment(shard);
+        if (ARRAY_MAX_SEGMENTS == segment) {
+            /* Shard can't grow any further! */
+            goto done;
         }
 
-        g_data_array_size = ARRAY_BLK_SZ;
+        new_segment = calloc(1, ARRAY_SEGMENT_BYTES(segment));
+        if (NULL == new_segment) {
+            /* Failed to allocate a new segment! */
+            goto done;
+        }
+    }
 
-    } else if (g_num_data_elements == g_data_array_size) {
-        /* Array is full, allocate more memory */
-        named_data_t ** temp;
+    /* Lock the shard so we can safely add our new element. */
+    data_lock_acquire(&shard->lock);
 
-        temp = realloc(
-            g_data_array,
-            (g_data_array_size + ARRAY_BLK_SZ) * sizeof(named_data_t*));
-        if (NULL == temp) {
-            /* Failed to increase size of data array! */
-            goto unlock;
-        }
-        g_data_array = temp;
-        g_data_array_size += ARRAY_BLK_SZ;
+    /*
+     * Append our data element to the end of the shard.
+     */
+    if (NULL != new_segment && true == install_data_segment(shard, segment, new_segment)) {
+        /* The shard owns our segment now. */
+        new_segment = NULL;
     }
 
-    g_data_array[g_num_data_elements] = new_element;
-    g_num_data_elements += 1;
+    /* Copy our element into the shard. */
+    if (false == store_data_element(shard, &new_element, node, NULL)) {
+        /* Out of memory! */
+        goto unlock;
+    }
 
     /* Success! */
     status = true;
 
 unlock:
-    /* Unlock the array so other threads can access it once more. */
-    pthread_mutex_unlock(&data_array_lock);
+    /* Unlock the shard so other threads can access it once more. */
+    data_lock_release(&shard->lock);
 
 done:
 
+    /* Someone else grew the shard first, so we didn't need our segment. */
+    free(new_segment);
+
     if (false == status) {
-        if (NULL != new_element) {
-            if (NULL != new_element->name) {
-                free(new_element->name);
-            }
-            free(new_element);
-        }
+        free(node);
+        free_data_element_name(&new_element);
     }
 
     return status;
@@ -5,32 +5,29 @@
  */
 
 #include "sample_test.h"
+#include "data_freeze.h"
 
-bool allocate_global_data_array_if_needed() {
+bool allocate_data_segment_if_needed(data_shard_t * shard, size_t * segment, data_slot_t ** new_segment) {
     bool status = false;
 
-    if (NULL == g_data_array) {
-        /* Array is not yet allocated */
-        g_data_array = malloc(ARRAY_BLK_SZ * sizeof(named_data_t*));
-        if (NULL == g_data_array) {
-            /* Failed to allocate memory for data array! */
+    *new_segment = NULL;
+
+    if (data_shard_full(shard)) {
+        /*
+         * Shard is full, attempt to make a new segment. Elements never move.
+         * This runs before the shard is locked, so that other appenders don't
+         * wait on the allocator.
+         */
+        *segment = data_shard_next_segment(shard);
+        if (ARRAY_MAX_SEGMENTS == *segment) {
+            /* Shard is full, and can't grow any further */
             goto done;
         }
-        g_data_array_size = ARRAY_BLK_SZ;
-    }
-
-    if (g_num_data_elements == g_data_array_size) {
-        /* Array is full, attempt to grow the array */
-        named_data_t ** temp;
-        temp = realloc(
-            g_data_array,
-            (g_data_array_size + ARRAY_BLK_SZ) * sizeof(named_data_t*));
-        if (NULL == temp) {
-            /* Array was is full, and we failed to allocate more memory */
+        *new_segment = calloc(1, ARRAY_SEGMENT_BYTES(*segment));
+        if (NULL == *new_segment) {
+            /* Shard was is full, and we failed to allocate more memory */
             goto done;
         }
-        g_data_array = temp;
-        g_data_array_size += ARRAY_BLK_SZ;
     }
 
     status = true;
@@ -39,29 +36,58 @@ done:
     return status;
 }
 
-bool add_element(named_data_t *new_element) {
+bool add_element(const named_data_t *new_element) {
     bool status = false;
-
-    /* Lock the array so we can safely add our new element. */
-    pthread_mutex_lock(&data_array_lock);
-
-    /*
-     * Append our data element to the end of the array.
-     */
-    if (false == allocate_global_data_array_if_needed()) {
-        /* Failed to allocate the global data array */
+    named_data_t * node = NULL;
+    data_shard_t * shard;
+    data_slot_t * new_segment = NULL;
+    size_t segment = 0;
+
+    /* Elements with the same name always go in the same shard. */
+    shard = data_array_shard(new_element->name_hash);
+
+    if (false == alloc_data_node(&node)) {
+        /* Failed to allocate the memory the array keeps our element in */
+    } else if (true == try_store_data_element(shard, new_element, node, NULL)) {
+        /* The shard had room, so we didn't have to lock it at all. */
+        status = true;
+    } else if (false == allocate_data_segment_if_needed(shard, &segment, &new_segment)) {
+        /* Failed to allocate the data shard's next segment */
     } else {
+        /* Lock the shard so we can safely add our new element. */
+        data_lock_acquire(&shard->lock);
+
         /*
-         * Successs
+         * Append our data element to the end of the shard.
          */
-        g_data_array[g_num_data_elements] = new_element;
-        g_num_data_elements += 1;
+        if (NULL == new_segment) {
+            /* The shard had room, or so it seemed */
+        } else if (false == install_data_segment(shard, segment, new_segment)) {
+            /* Someone else grew the shard first, so we don't need our segment */
+        } else {
+            /* The shard owns our segment now */
+            new_segment = NULL;
+        }
 
-        status = true;
+        if (false == store_data_element(shard, new_element, node, NULL)) {
+            /* Failed to copy the element into the shard */
+        } else {
+            /*
+             * Successs
+             */
+            status = true;
+        }
+
+        /* Unlock the shard so other threads can access it once more. */
+        data_lock_release(&shard->lock);
+
+        free(new_segment);
     }
 
-    /* Unlock the array so other threads can access it once more. */
-    pthread_mutex_unlock(&data_array_lock);
+    /* Clean up, as needed */
+    if (false == status) {
+        free(node);
+    }
 
     return status;
 }
@@ -76,20 +102,20 @@ bool add_element(named_data_t *new_element) {
  */
 bool append_data_element(const char * name, void * data) {
     bool status = false;
-    named_data_t *new_element = NULL;
+    named_data_t new_element = {0};
 
     if (NULL == name || NULL == data) {
         /* Bad args! */
         printf("add_named_rectangle: Invalid arguments!\n");
-    } else if (NULL == (new_element = malloc(sizeof(named_data_t)))) {
-        /* Out of memory! */
-    } else if (NULL == (new_element->name = strdup(name))){
+    } else if (data_array_frozen()) {
+        /* No appends until the array is unfrozen! */
+    } else if (false == set_data_element_name(&new_element, name)) {
         /* Out of memory! */
     } else {
         /* We're given ownership of the data, so we'll assign the pointer. */
-        new_element->data = data;
+        new_element.data = data;
 
-        if (false == add_element(new_element)) {
+        if (false == add_element(&new_element)) {
             /* Failed to add element */
         } else {
             /*
@@ -102,12 +128,7 @@ bool append_data_element(const char * name, void * data) {
 
     /* Clean up, as needed */
     if (false == status) {
-        if (NULL != new_element) {
-            if (NULL != new_element->name) {
-                free(new_element->name);
-            }
-            free(new_element);
-        }
+        free_data_element_name(&new_element);
     }
 
     return status;
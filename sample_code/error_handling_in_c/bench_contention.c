@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Benchmark for appending to the global data array from many threads at once.
+ *
+ * Appends the same number of elements with 1, 2, 4, ... threads, splitting
+ * them evenly between the threads, first one append_data_element() at a time,
+ * then through each thread's buffer (see data_buffer.c), and then all at once
+ * with load_data_elements() (see data_load.c). It's built once for each
+ * variant of the data array (see data_array.h), for comparison.
+ *
+ * Usage: bench_contention [num_elements] [max_threads]
+ */
+
+/* Standard headers */
+#include <stdbool.h>    /* For bool */
+#include <stdlib.h>     /* For malloc/free */
+#include <stdio.h>      /* For printf */
+#include <time.h>       /* For clock_gettime */
+
+/* 3rd-party headers */
+#include <pthread.h>
+
+/* Our headers */
+#include "sample_test.h"
+#include "data_buffer.h"
+#include "data_load.h"
+
+#define DEFAULT_NUM_ELEMENTS 1000000
+#define DEFAULT_MAX_THREADS  64
+
+/* Room for "element-" and any 64-bit number */
+#define BENCH_NAME_SZ 32
+
+typedef struct {
+    pthread_t thread;
+    char *    names;        /* This thread's share of the names */
+    size_t    num_names;
+    bool      buffered;     /* Use buffer_data_element() instead of append_data_element() */
+    bool      status;
+} bench_thread_t;
+
+/**
+ * @brief Get a monotonic timestamp.
+ *
+ * @return double   Time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Thread that appends its share of the elements.
+ *
+ * @param arg       The bench_thread_t for this thread.
+ * @return void*    NULL. Success or failure is recorded in the bench_thread_t.
+ */
+static void * append_thread(void * arg) {
+    bench_thread_t * bench_thread = arg;
+    size_t i;
+
+    for (i = 0; i < bench_thread->num_names; i++) {
+        char * name = &bench_thread->names[i * BENCH_NAME_SZ];
+
+        if (true == bench_thread->buffered) {
+            if (false == buffer_data_element(name, (void *)name)) {
+                return NULL;
+            }
+        } else if (false == append_data_element(name, (void *)name)) {
+            return NULL;
+        }
+    }
+
+    if (true == bench_thread->buffered && false == flush_data_elements()) {
+        return NULL;
+    }
+
+    bench_thread->status = true;
+    return NULL;
+}
+
+int main(int argc, char ** argv) {
+    int status = 1;
+    size_t num_elements = DEFAULT_NUM_ELEMENTS;
+    size_t max_threads  = DEFAULT_MAX_THREADS;
+    char * names        = NULL;
+    const char ** name_ptrs  = NULL;
+    bench_thread_t * threads = NULL;
+    size_t num_threads;
+    size_t num_started = 0;
+    int buffered;
+    bool loaded;
+    double start;
+    double append_time;
+    data_lock_stats_t before;
+    data_lock_stats_t after;
+    size_t i;
+
+    if (argc > 1) {
+        num_elements = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        max_threads = strtoul(argv[2], NULL, 10);
+    }
+    if (0 == num_elements || 0 == max_threads) {
+        printf("Usage: %s [num_elements] [max_threads]\n", argv[0]);
+        goto done;
+    }
+
+    /* Make the names up front so we don't time snprintf. */
+    names = malloc(num_elements * BENCH_NAME_SZ);
+    name_ptrs = malloc(num_elements * sizeof(const char *));
+    threads = calloc(max_threads, sizeof(bench_thread_t));
+    if (NULL == names || NULL == name_ptrs || NULL == threads) {
+        printf("Failed to allocate names\n");
+        goto done;
+    }
+    for (i = 0; i < num_elements; i++) {
+        snprintf(&names[i * BENCH_NAME_SZ], BENCH_NAME_SZ, "element-%zu", i);
+        name_ptrs[i] = &names[i * BENCH_NAME_SZ];
+    }
+
+    printf("layout:     %s\n", DATA_ARRAY_INLINE ? "inline" : "pointer");
+    printf("names:      %s\n", DATA_NAMES_INTERNED ? "interned" : "inline/arena");
+    printf("shards:     %d\n", DATA_ARRAY_NUM_SHARDS);
+    printf("appends:    %s\n", DATA_ARRAY_LOCK_FREE ? "lock-free" : "locked");
+    printf("locks:      %s\n", DATA_LOCK_FUTEX ? "spin then futex" : "pthread mutex");
+    printf("elements:   %zu\n", num_elements);
+
+    for (num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        size_t per_thread = num_elements / num_threads;
+
+        for (buffered = 0; buffered <= 1; buffered++) {
+            data_array_lock_stats(&before);
+            start = now();
+            for (num_started = 0; num_started < num_threads; num_started++) {
+                bench_thread_t * bench_thread = &threads[num_started];
+
+                bench_thread->names     = &names[num_started * per_thread * BENCH_NAME_SZ];
+                bench_thread->num_names = num_started + 1 < num_threads
+                                              ? per_thread
+                                              : num_elements - num_started * per_thread;
+                bench_thread->buffered  = buffered;
+                bench_thread->status    = false;
+                if (0 != pthread_create(&bench_thread->thread, NULL, append_thread, bench_thread)) {
+                    printf("Failed to start thread %zu\n", num_started);
+                    goto done;
+                }
+            }
+            for (i = 0; i < num_started; i++) {
+                pthread_join(threads[i].thread, NULL);
+            }
+            num_started = 0;
+            append_time = now() - start;
+            data_array_lock_stats(&after);
+
+            for (i = 0; i < num_threads; i++) {
+                if (false == threads[i].status) {
+                    printf("Failed to add elements from thread %zu\n", i);
+                    goto done;
+                }
+            }
+
+            printf("threads: %3zu  %-8s  %8.2f ns/element  %8.2f M elements/s"
+                   "  locks: %9llu  contended: %9llu  waited: %8.2f ms\n",
+                   num_threads,
+                   buffered ? "buffered" : "append",
+                   append_time * 1e9 / num_elements,
+                   num_elements / append_time / 1e6,
+                   (unsigned long long)(after.acquisitions - before.acquisitions),
+                   (unsigned long long)(after.contended - before.contended),
+                   (after.wait_ns - before.wait_ns) / 1e6);
+
+            free_data_array();
+        }
+
+        data_array_lock_stats(&before);
+        start = now();
+        loaded = load_data_elements(name_ptrs, (void * const *)name_ptrs, num_elements, num_threads);
+        append_time = now() - start;
+        data_array_lock_stats(&after);
+
+        if (false == loaded) {
+            printf("Failed to load elements on %zu threads\n", num_threads);
+            goto done;
+        }
+
+        printf("threads: %3zu  %-8s  %8.2f ns/element  %8.2f M elements/s"
+               "  locks: %9llu  contended: %9llu  waited: %8.2f ms\n",
+               num_threads,
+               "loaded",
+               append_time * 1e9 / num_elements,
+               num_elements / append_time / 1e6,
+               (unsigned long long)(after.acquisitions - before.acquisitions),
+               (unsigned long long)(after.contended - before.contended),
+               (after.wait_ns - before.wait_ns) / 1e6);
+
+        free_data_array();
+    }
+
+    status = 0;
+
+done:
+    for (i = 0; i < num_started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    free_data_array();
+    free(threads);
+    free(name_ptrs);
+    free(names);
+    return status;
+}
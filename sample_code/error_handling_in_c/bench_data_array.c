@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Benchmark for the global data array.
+ *
+ * Times appending elements, scanning them, and freeing them, both on one
+ * thread and on BENCH_TEARDOWN_THREADS. It's built once for each variant of
+ * the data array (see data_array.h), for comparison.
+ *
+ * Usage: bench_data_array [num_elements] [num_scans]
+ */
+
+/* Standard headers */
+#include <stdbool.h>    /* For bool */
+#include <stdint.h>     /* For uintptr_t */
+#include <stdlib.h>     /* For malloc/free */
+#include <stdio.h>      /* For printf */
+#include <time.h>       /* For clock_gettime */
+
+/* Our headers */
+#include "sample_test.h"
+
+#define DEFAULT_NUM_ELEMENTS 1000000
+#define DEFAULT_NUM_SCANS    10
+
+#define BENCH_TEARDOWN_THREADS 8
+
+#define BENCH_BATCH_SZ 4096
+
+/* Room for "element-" and any 64-bit number */
+#define BENCH_NAME_SZ 32
+
+/**
+ * @brief Get a monotonic timestamp.
+ *
+ * @return double   Time in seconds.
+ */
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Add every element to the array.
+ *
+ * @param names         The names, BENCH_NAME_SZ apart.
+ * @param num_elements  Number of names.
+ * @return true         Added all of them.
+ * @return false        Failed to add one.
+ */
+static bool fill_data_array(char * names, size_t num_elements) {
+    size_t i;
+
+    for (i = 0; i < num_elements; i++) {
+        if (false == append_data_element(&names[i * BENCH_NAME_SZ], (void *)&names[i * BENCH_NAME_SZ])) {
+            printf("Failed to add element %zu to array\n", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Scan visitor that should never be called.
+ *
+ * @param element   The element.
+ * @param ctx       Unused.
+ * @return false    Stop the scan.
+ */
+static bool stop_scan(named_data_t * element, void * ctx) {
+    (void)element;
+    (void)ctx;
+    return false;
+}
+
+/**
+ * @brief Chunk visitor that adds up the same checksum as the plain scan.
+ *
+ * @param elements      The elements in the chunk.
+ * @param num_elements  Number of elements in the chunk.
+ * @param ctx           Pointer to the checksum.
+ * @return true         Keep scanning.
+ */
+static bool checksum_chunk(named_data_t * const * elements, size_t num_elements, void * ctx) {
+    size_t i;
+
+    for (i = 0; i < num_elements; i++) {
+        *(uintptr_t *)ctx += (uintptr_t)elements[i]->name_len ^ (uintptr_t)elements[i]->data;
+    }
+
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    int status = 1;
+    size_t num_elements = DEFAULT_NUM_ELEMENTS;
+    size_t num_scans    = DEFAULT_NUM_SCANS;
+    char * names        = NULL;
+    const char ** name_ptrs = NULL;
+    uintptr_t checksum  = 0;
+    double start;
+    double append_time;
+    double batch_time;
+    double scan_time;
+    double chunk_scan_time;
+    double filter_time;
+    double free_time;
+    double parallel_free_time;
+    double skip_free_time;
+    data_teardown_options_t teardown_options = {0};
+    data_array_stats_t stats;
+    size_t i;
+    size_t scan;
+    size_t shard;
+
+    if (argc > 1) {
+        num_elements = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        num_scans = strtoul(argv[2], NULL, 10);
+    }
+    if (0 == num_elements || 0 == num_scans) {
+        printf("Usage: %s [num_elements] [num_scans]\n", argv[0]);
+        goto done;
+    }
+
+    /* Make the names up front so we don't time snprintf. */
+    names     = malloc(num_elements * BENCH_NAME_SZ);
+    name_ptrs = malloc(num_elements * sizeof(const char *));
+    if (NULL == names || NULL == name_ptrs) {
+        printf("Failed to allocate names\n");
+        goto done;
+    }
+    for (i = 0; i < num_elements; i++) {
+        snprintf(&names[i * BENCH_NAME_SZ], BENCH_NAME_SZ, "element-%zu", i);
+        name_ptrs[i] = &names[i * BENCH_NAME_SZ];
+    }
+
+    start = now();
+    if (false == fill_data_array(names, num_elements)) {
+        goto done;
+    }
+    append_time = now() - start;
+    get_data_array_stats(&stats);
+
+    start = now();
+    for (scan = 0; scan < num_scans; scan++) {
+        for (shard = 0; shard < DATA_ARRAY_NUM_SHARDS; shard++) {
+            for (i = 0; i < g_data_shards[shard].num_elements; i++) {
+                named_data_t * element = data_shard_element(&g_data_shards[shard], i);
+
+                checksum += (uintptr_t)element->name_len ^ (uintptr_t)element->data;
+            }
+        }
+    }
+    scan_time = now() - start;
+
+    start = now();
+    for (scan = 0; scan < num_scans; scan++) {
+        (void)for_each_data_element(checksum_chunk, &checksum);
+    }
+    chunk_scan_time = now() - start;
+
+    /* Scan by a name no element has, so every element's hash is checked. */
+    start = now();
+    for (scan = 0; scan < num_scans; scan++) {
+        checksum += scan_data_elements_by_name("no-such-element", stop_scan, NULL);
+    }
+    filter_time = now() - start;
+
+    start = now();
+    free_data_array();
+    free_time = now() - start;
+
+    if (false == fill_data_array(names, num_elements)) {
+        goto done;
+    }
+    teardown_options.num_threads = BENCH_TEARDOWN_THREADS;
+    start = now();
+    teardown_data_array(&teardown_options);
+    parallel_free_time = now() - start;
+
+    /* Leaks every element, as a process that's about to exit would. */
+    if (false == fill_data_array(names, num_elements)) {
+        goto done;
+    }
+    teardown_options.skip_element_frees = true;
+    start = now();
+    teardown_data_array(&teardown_options);
+    skip_free_time = now() - start;
+
+    start = now();
+    for (i = 0; i < num_elements; i += BENCH_BATCH_SZ) {
+        size_t batch_size = num_elements - i < BENCH_BATCH_SZ ? num_elements - i : BENCH_BATCH_SZ;
+
+        if (batch_size != append_data_elements(&name_ptrs[i], (void * const *)&name_ptrs[i], batch_size, NULL)) {
+            printf("Failed to append batch at element %zu\n", i);
+            goto done;
+        }
+    }
+    batch_time = now() - start;
+
+    printf("layout:     %s\n", DATA_ARRAY_INLINE ? "inline" : "pointer");
+    printf("names:      %s\n", DATA_NAMES_INTERNED ? "interned" : "inline/arena");
+    printf("shards:     %d\n", DATA_ARRAY_NUM_SHARDS);
+    printf("elements:   %zu\n", num_elements);
+    printf("memory:     %8.2f bytes/element (%llu growths)\n",
+           (double)stats.bytes_used / num_elements, (unsigned long long)stats.num_growths);
+    printf("append:     %8.2f ns/element\n", append_time * 1e9 / num_elements);
+    printf("append:     %8.2f ns/element (batches of %d)\n", batch_time * 1e9 / num_elements, BENCH_BATCH_SZ);
+    printf("scan:       %8.2f ns/element (%zu scans)\n", scan_time * 1e9 / (num_elements * num_scans), num_scans);
+    printf("scan:       %8.2f ns/element (%zu scans, chunks of %d)\n",
+           chunk_scan_time * 1e9 / (num_elements * num_scans), num_scans, DATA_SCAN_CHUNK_SZ);
+    printf("filter:     %8.2f ns/element (%zu scans)\n", filter_time * 1e9 / (num_elements * num_scans), num_scans);
+    printf("free:       %8.2f ns/element\n", free_time * 1e9 / num_elements);
+    printf("free:       %8.2f ns/element (%d threads)\n",
+           parallel_free_time * 1e9 / num_elements, BENCH_TEARDOWN_THREADS);
+    printf("free:       %8.2f ns/element (skipping element frees)\n", skip_free_time * 1e9 / num_elements);
+    printf("checksum:   %zx\n", (size_t)checksum);
+
+    status = 0;
+
+done:
+    free_data_array();
+    free(name_ptrs);
+    free(names);
+    return status;
+}
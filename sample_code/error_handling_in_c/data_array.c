@@ -0,0 +1,2238 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * The global growable array of named data elements.
+ */
+
+/* Standard headers */
+#include <stdatomic.h>  /* For atomic_load_explicit/atomic_store_explicit */
+#include <stdbool.h>    /* For bool */
+#include <stdint.h>     /* For uint32_t */
+#include <stdlib.h>     /* For malloc/free */
+#include <string.h>     /* For memcmp/memcpy/memset/strlen */
+
+/* 3rd-party headers */
+#include <pthread.h>
+#include <sched.h>      /* For sched_yield */
+
+/* Our headers */
+#include "data_array.h"
+#include "data_freeze.h"
+#include "data_index.h"
+#include "data_lock.h"
+#include "data_rcu.h"
+#include "name_arena.h"
+#include "name_intern.h"
+
+data_shard_t g_data_shards[DATA_ARRAY_NUM_SHARDS];
+
+/*
+ * Adding an element to a shard takes two steps. First the appender reserves a
+ * slot by bumping num_reserved, which it can do without the shard's lock as
+ * long as the slot it gets is in a segment that already exists. Then it fills
+ * the slot in and publishes it.
+ *
+ * Every element below num_elements is complete, so readers never have to
+ * check the slots one by one. With the lock, publishing a slot is just bumping
+ * num_elements. Without it, slots can be filled in out of order, so each one
+ * has a ready flag. An appender sets its slot's flag, then moves num_elements
+ * past every ready slot it finds there. If the slot before its own isn't ready
+ * yet, the appender of that slot will move num_elements past both of them, so
+ * no appender ever waits for another.
+ *
+ * Setting the top bit of num_reserved closes the shard to new reservations.
+ * close_data_shard() does this so that no appender can slip in around the
+ * lock, and it stays closed for as long as the array is frozen.
+ */
+#define DATA_SHARD_CLOSED ((size_t)1 << (sizeof(size_t) * CHAR_BIT - 1))
+
+static pthread_once_t g_data_shards_once = PTHREAD_ONCE_INIT;
+
+/* Generation every slot map entry starts out in, for handles. Moves on each time the array is freed. */
+static _Atomic uint32_t g_data_array_generation = 1;
+
+/* Latest generation any entry has moved on to, so the next array can start past it */
+static _Atomic uint32_t g_data_entry_max_generation = 1;
+
+/**
+ * @brief Initialize the shard locks. Use init_data_shards() to call this.
+ */
+static void init_data_shard_locks(void) {
+    size_t i;
+
+    for (i = 0; i < DATA_ARRAY_NUM_SHARDS; i++) {
+        data_lock_init(&g_data_shards[i].lock);
+    }
+}
+
+/**
+ * @brief Make sure the shards are ready to be locked.
+ */
+static void init_data_shards(void) {
+    pthread_once(&g_data_shards_once, init_data_shard_locks);
+}
+
+/**
+ * @brief Get the number of the shard that holds the elements with a given name.
+ *
+ * Uses the top bits of the hash, since the index within the shard uses the
+ * bottom ones.
+ *
+ * @param name_hash     data_name_hash() of the name.
+ * @return size_t       Index of the shard in g_data_shards.
+ */
+static size_t data_shard_number(uint32_t name_hash) {
+    return ((uint64_t)name_hash * DATA_ARRAY_NUM_SHARDS) >> 32;
+}
+
+/**
+ * @brief Get the shard that holds the elements with a given name.
+ *
+ * @param name_hash         data_name_hash() of the name.
+ * @return data_shard_t*    The shard.
+ */
+data_shard_t * data_array_shard(uint32_t name_hash) {
+    init_data_shards();
+
+    return &g_data_shards[data_shard_number(name_hash)];
+}
+
+/**
+ * @brief Lock a shard, and close it to appenders that don't take the lock.
+ *
+ * Any of those appenders that already have a slot are waited for, so the
+ * shard's first num_elements slots are all it has.
+ *
+ * @param shard     The shard.
+ */
+static void close_data_shard(data_shard_t * shard) {
+    size_t num_reserved;
+
+    data_lock_acquire(&shard->lock);
+
+    /* Appenders with a slot are only a few stores away from publishing it. */
+    num_reserved = atomic_fetch_or(&shard->num_reserved, DATA_SHARD_CLOSED) & ~DATA_SHARD_CLOSED;
+    while (num_reserved != atomic_load_explicit(&shard->num_elements, memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Unlock a shard locked by close_data_shard().
+ *
+ * The shard stays closed to appenders that don't take the lock if the array
+ * is frozen. Those appenders will take the lock, and find out that it is.
+ *
+ * @param shard     The shard.
+ * @param frozen    Whether the array is frozen.
+ */
+static void reopen_data_shard(data_shard_t * shard, bool frozen) {
+    if (false == frozen) {
+        atomic_fetch_and(&shard->num_reserved, ~DATA_SHARD_CLOSED);
+    }
+    data_lock_release(&shard->lock);
+}
+
+/**
+ * @brief Lock every shard, so the whole array can't change.
+ *
+ * The shards are always locked in the same order, so two threads doing this
+ * can't deadlock. Each shard is also closed to appenders that don't take the
+ * lock, and any of them that already have a slot are waited for.
+ */
+void lock_data_shards(void) {
+    size_t i;
+
+    init_data_shards();
+
+    for (i = 0; i < DATA_ARRAY_NUM_SHARDS; i++) {
+        close_data_shard(&g_data_shards[i]);
+    }
+}
+
+/**
+ * @brief Unlock every shard locked by lock_data_shards().
+ *
+ * Shards stay closed to appenders that don't take the lock if the array is
+ * frozen. Those appenders will take the lock, and find out that it is.
+ */
+void unlock_data_shards(void) {
+    bool frozen = data_array_frozen();
+    size_t i;
+
+    for (i = DATA_ARRAY_NUM_SHARDS; i > 0; i--) {
+        reopen_data_shard(&g_data_shards[i - 1], frozen);
+    }
+}
+
+/**
+ * @brief Find how many more elements a shard can take before it must grow.
+ *
+ * Doesn't need the shard's lock, though the answer may be stale by the time
+ * the caller acts on it.
+ *
+ * @param shard     The shard.
+ * @return size_t   Number of slots that haven't been handed out yet.
+ */
+size_t data_shard_room(const data_shard_t * shard) {
+    size_t num_reserved = atomic_load_explicit(&shard->num_reserved, memory_order_relaxed) & ~DATA_SHARD_CLOSED;
+    size_t size         = atomic_load_explicit(&shard->size, memory_order_relaxed);
+
+    return num_reserved < size ? size - num_reserved : 0;
+}
+
+/**
+ * @brief Check if every slot in a shard has been handed out.
+ *
+ * Doesn't need the shard's lock, though the answer may be stale by the time
+ * the caller acts on it.
+ *
+ * @param shard     The shard.
+ * @return true     The shard must grow before it can take another element.
+ * @return false    The shard has room.
+ */
+bool data_shard_full(const data_shard_t * shard) {
+    return 0 == data_shard_room(shard);
+}
+
+/**
+ * @brief Find which segment a shard will add next.
+ *
+ * Doesn't need the shard's lock, so appenders can allocate the segment before
+ * taking it. See install_data_segment().
+ *
+ * @param shard     The shard.
+ * @return size_t   Segment number, or ARRAY_MAX_SEGMENTS if the shard can't grow any further.
+ */
+size_t data_shard_next_segment(const data_shard_t * shard) {
+    size_t offset;
+
+    /* The segments so far fill the shard exactly, so the next one starts at its size. */
+    return data_array_locate(atomic_load_explicit(&shard->size, memory_order_relaxed), &offset);
+}
+
+/**
+ * @brief Add a segment that was allocated without the shard's lock.
+ *
+ * The caller must hold the shard's lock. This is just a few stores, so that
+ * other appenders never wait on the allocator. If another thread has grown
+ * the shard since the segment was allocated, it's the wrong size, and the
+ * caller still owns it.
+ *
+ * @param shard         The shard.
+ * @param segment       Segment number, from data_shard_next_segment().
+ * @param new_segment   The segment, ARRAY_SEGMENT_BYTES(segment) of zeroed memory.
+ * @return true         Segment added. The shard owns it now.
+ * @return false        The shard already has that segment.
+ */
+bool install_data_segment(data_shard_t * shard, size_t segment, data_slot_t * new_segment) {
+    if (segment != shard->num_segments) {
+        /* Someone else grew the shard first. */
+        return false;
+    }
+
+    /* Appenders that see the new size also see the new segment. */
+    shard->segments[segment] = new_segment;
+    shard->size += ARRAY_SEGMENT_SIZE(segment);
+    shard->num_segments += 1;
+    atomic_fetch_add_explicit(&shard->num_growths, 1, memory_order_relaxed);
+
+    return true;
+}
+
+/**
+ * @brief Add a segment to a shard.
+ *
+ * The caller must hold the shard's lock. Appenders should allocate the
+ * segment before they lock the shard instead, see install_data_segment().
+ *
+ * @param shard     The shard.
+ * @return true     Segment added.
+ * @return false    The shard can't grow any further, or out of memory.
+ */
+static bool grow_data_shard(data_shard_t * shard) {
+    bool status = false;
+    data_slot_t * new_segment;
+
+    if (ARRAY_MAX_SEGMENTS == shard->num_segments) {
+        /* Shard can't grow any further! */
+        goto done;
+    }
+
+    new_segment = calloc(1, ARRAY_SEGMENT_BYTES(shard->num_segments));
+    if (NULL == new_segment) {
+        /* Failed to allocate a new segment! */
+        goto done;
+    }
+
+    (void)install_data_segment(shard, shard->num_segments, new_segment);
+
+    status = true;
+
+done:
+    return status;
+}
+
+/**
+ * @brief Reserve the next slot in a shard, if there's room for it.
+ *
+ * @param shard         The shard.
+ * @param[out] index    Index of the reserved slot.
+ * @return true         Slot reserved. It must be published.
+ * @return false        The shard is full, or closed.
+ */
+static bool reserve_data_slot(data_shard_t * shard, size_t * index) {
+    size_t num_reserved = atomic_load_explicit(&shard->num_reserved, memory_order_relaxed);
+
+    /*
+     * Only take a slot in a segment that exists, so that every reserved slot
+     * is sure to be published and the ones after it never wait forever.
+     */
+    do {
+        if (0 != (num_reserved & DATA_SHARD_CLOSED) ||
+            num_reserved >= atomic_load_explicit(&shard->size, memory_order_acquire)) {
+            return false;
+        }
+    } while (false == atomic_compare_exchange_weak_explicit(
+                          &shard->num_reserved, &num_reserved, num_reserved + 1,
+                          memory_order_relaxed, memory_order_relaxed));
+
+    *index = num_reserved;
+    return true;
+}
+
+/**
+ * @brief Fill in a reserved slot, and publish it.
+ *
+ * @param shard     The shard.
+ * @param index     Index of the slot, from reserve_data_slot().
+ * @param element   Element to store.
+ * @param node      Memory for the element, if the slots hold pointers.
+ */
+static void publish_data_slot(data_shard_t * shard, size_t index, const named_data_t * element, named_data_t * node) {
+    size_t segment;
+    size_t offset;
+
+    segment = data_array_locate(index, &offset);
+#if DATA_ARRAY_INLINE
+    (void)node;
+    shard->segments[segment][offset] = *element;
+#else
+    *node = *element;
+    shard->segments[segment][offset] = node;
+#endif
+    data_segment_hashes(shard, segment)[offset]    = element->name_hash;
+    atomic_store_explicit(&data_segment_name_lens(shard, segment)[offset], element->name_len, memory_order_relaxed);
+
+#if DATA_ARRAY_LOCK_FREE
+    {
+        size_t num_elements;
+
+        atomic_store(&data_segment_ready(shard, segment)[offset], 1);
+
+        /* Move num_elements past our slot, and any ready slots after it. */
+        num_elements = atomic_load(&shard->num_elements);
+        while (num_elements < atomic_load_explicit(&shard->size, memory_order_acquire)) {
+            segment = data_array_locate(num_elements, &offset);
+            if (0 == atomic_load(&data_segment_ready(shard, segment)[offset])) {
+                /* Whoever is filling this one in will carry on from here. */
+                break;
+            }
+            if (atomic_compare_exchange_weak(&shard->num_elements, &num_elements, num_elements + 1)) {
+                num_elements += 1;
+            }
+        }
+    }
+#else
+    atomic_store_explicit(&shard->num_elements, index + 1, memory_order_release);
+#endif
+}
+
+/**
+ * @brief Get the slot map entry of the element in a slot.
+ *
+ * @param shard     The shard.
+ * @param index     Index of the slot, must be less than shard->size.
+ * @return size_t   Index of the entry.
+ */
+static size_t data_slot_entry(const data_shard_t * shard, size_t index) {
+    size_t offset;
+    size_t segment = data_array_locate(index, &offset);
+    uint32_t entry = data_segment_entries(shard, segment)[offset];
+
+    return 0 == entry ? index : (size_t)entry - 1;
+}
+
+/**
+ * @brief Get the slot a slot map entry's element is in.
+ *
+ * @param shard     The shard.
+ * @param entry     Index of the entry, must be less than shard->size.
+ * @return size_t   Index of the slot.
+ */
+static size_t data_entry_slot(const data_shard_t * shard, size_t entry) {
+    size_t offset;
+    size_t segment = data_array_locate(entry, &offset);
+    uint32_t index = data_segment_entry_slots(shard, segment)[offset];
+
+    return 0 == index ? entry : (size_t)index - 1;
+}
+
+/**
+ * @brief Map a slot and a slot map entry to each other.
+ *
+ * @param shard     The shard, locked by close_data_shard().
+ * @param index     Index of the slot.
+ * @param entry     Index of the entry.
+ */
+static void map_data_slot_entry(data_shard_t * shard, size_t index, size_t entry) {
+    size_t offset;
+    size_t segment;
+
+    segment = data_array_locate(index, &offset);
+    data_segment_entries(shard, segment)[offset] = index == entry ? 0 : (uint32_t)(entry + 1);
+
+    segment = data_array_locate(entry, &offset);
+    data_segment_entry_slots(shard, segment)[offset] = index == entry ? 0 : (uint32_t)(index + 1);
+}
+
+/**
+ * @brief Get the current generation of a slot map entry.
+ *
+ * @param shard         The shard.
+ * @param entry         Index of the entry, must be less than shard->size.
+ * @return uint32_t     The generation, never 0.
+ */
+static uint32_t data_entry_generation(const data_shard_t * shard, size_t entry) {
+    size_t offset;
+    size_t segment = data_array_locate(entry, &offset);
+    uint32_t generation =
+        atomic_load_explicit(&data_segment_entry_generations(shard, segment)[offset], memory_order_acquire);
+
+    if (0 == generation) {
+        /* Still the one the array started with. */
+        generation = atomic_load_explicit(&g_data_array_generation, memory_order_relaxed);
+    }
+
+    return generation;
+}
+
+/**
+ * @brief Get the generation after a generation.
+ *
+ * @param generation    The generation.
+ * @return uint32_t     The next one. Wraps around, but never to 0.
+ */
+static uint32_t next_data_generation(uint32_t generation) {
+    generation = (generation + 1) & ((1u << DATA_HANDLE_GENERATION_BITS) - 1);
+
+    return 0 == generation ? 1 : generation;
+}
+
+/**
+ * @brief Move a slot map entry on to its next generation, so the handles to
+ *        its element are stale.
+ *
+ * The caller must hold the shard's lock.
+ *
+ * @param shard     The shard.
+ * @param entry     Index of the entry.
+ */
+static void retire_data_entry(data_shard_t * shard, size_t entry) {
+    size_t offset;
+    size_t segment         = data_array_locate(entry, &offset);
+    uint32_t generation     = next_data_generation(data_entry_generation(shard, entry));
+    uint32_t max_generation = atomic_load_explicit(&g_data_entry_max_generation, memory_order_relaxed);
+
+    atomic_store_explicit(&data_segment_entry_generations(shard, segment)[offset], generation, memory_order_release);
+
+    /* Other shards may be moving theirs on too. */
+    while (generation > max_generation &&
+           false == atomic_compare_exchange_weak_explicit(&g_data_entry_max_generation, &max_generation, generation,
+                                                          memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Make the handle for an element.
+ *
+ * @param shard             The shard the element is in.
+ * @param index             Index of the element within the shard.
+ * @return data_handle_t    The handle.
+ * @return DATA_HANDLE_INVALID  The entry is too big for a handle.
+ */
+static data_handle_t make_data_handle(const data_shard_t * shard, size_t index) {
+    size_t entry = data_slot_entry(shard, index);
+
+    if (entry >= (size_t)UINT32_MAX) {
+        /* More elements in the shard than the slot map can count! */
+        return DATA_HANDLE_INVALID;
+    }
+
+    return ((data_handle_t)data_entry_generation(shard, entry) << (DATA_HANDLE_ENTRY_BITS + DATA_HANDLE_SHARD_BITS)) |
+           ((data_handle_t)(shard - g_data_shards) << DATA_HANDLE_ENTRY_BITS) |
+           (data_handle_t)entry;
+}
+
+/**
+ * @brief Find the slot of the element a handle is for.
+ *
+ * Inside a read section, or with the shard's lock held.
+ *
+ * @param shard         The shard the handle is for.
+ * @param handle        The handle.
+ * @param[out] index    Index of the element within the shard.
+ * @return true         Found it.
+ * @return false        The handle is stale: the element was removed, or the
+ *                      array has been freed since. Or it was never valid.
+ */
+static bool find_data_handle_slot(const data_shard_t * shard, data_handle_t handle, size_t * index) {
+    size_t entry = data_handle_entry(handle);
+
+    if (entry >= atomic_load_explicit(&shard->size, memory_order_acquire) ||
+        data_entry_generation(shard, entry) != data_handle_generation(handle)) {
+        /* No such entry, or its element was removed since. */
+        return false;
+    }
+
+    *index = data_entry_slot(shard, entry);
+    if (*index >= atomic_load_explicit(&shard->num_elements, memory_order_acquire) ||
+        true == data_shard_removed(shard, *index)) {
+        /* Not added yet, or removed since. */
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Copy a name into an element.
+ *
+ * Short names are stored inside the element. Long names are copied into the
+ * name arena, so no name costs a heap allocation of its own. Interned names
+ * are shared with every other element of the same name instead. Use
+ * data_element_name() to read the name back.
+ *
+ * The name's hash is worked out here too, once, since the shard, the index and
+ * the segment's hash column all need it.
+ *
+ * The name needn't be NULL-terminated, so it can be a slice of a bigger
+ * buffer. It's copied with a single memcpy, and the copy is terminated.
+ *
+ * @param element   The element. Any name it already has is not freed.
+ * @param name      Name to copy.
+ * @param name_len  Length of the name.
+ * @return true     Name copied.
+ * @return false    Out of memory, or the name is too long.
+ */
+bool set_data_element_name_n(named_data_t * element, const char * name, size_t name_len) {
+    bool status = false;
+    uint32_t hash;
+
+    if (name_len >= DATA_NAME_REMOVED) {
+        /* Name too long! */
+        goto done;
+    }
+
+    hash = data_name_hash(name, name_len);
+
+#if DATA_NAMES_INTERNED
+    /* Share the copy any other element with this name is already using. */
+    element->name_buf.long_name = intern_name(name, name_len, hash);
+    if (NULL == element->name_buf.long_name) {
+        /* Out of memory! */
+        goto done;
+    }
+#else
+    if (name_len < DATA_NAME_INLINE_SZ) {
+        memcpy(element->name_buf.inline_name, name, name_len);
+        element->name_buf.inline_name[name_len] = '\0';
+    } else {
+        char * long_name = name_arena_alloc(name_len + 1, &element->name_buf.long_name_block);
+
+        if (NULL == long_name) {
+            /* Out of memory! */
+            goto done;
+        }
+        memcpy(long_name, name, name_len);
+        long_name[name_len] = '\0';
+        element->name_buf.long_name = long_name;
+    }
+#endif
+    element->name_len  = (uint32_t)name_len;
+    element->name_hash = hash;
+
+    status = true;
+
+done:
+    return status;
+}
+
+/**
+ * @brief Copy a NULL-terminated name into an element.
+ *
+ * See set_data_element_name_n().
+ *
+ * @param element   The element. Any name it already has is not freed.
+ * @param name      NULL-terminated name to copy.
+ * @return true     Name copied.
+ * @return false    Out of memory, or the name is too long.
+ */
+bool set_data_element_name(named_data_t * element, const char * name) {
+    return set_data_element_name_n(element, name, strlen(name));
+}
+
+/**
+ * @brief Give an element a name that was allocated with malloc().
+ *
+ * The element takes ownership of the name, whether or not this succeeds. Long
+ * names are kept as they are, rather than copied, and freed with free() when
+ * the element lets go of them: once it's removed and no reader can be using
+ * it, when the array is freed, or straight away if it's never added (see
+ * free_data_element_name()). Short names are copied into the element anyway,
+ * and interned names into the intern table, and then the name is freed
+ * straight away.
+ *
+ * @param element   The element. Any name it already has is not freed.
+ * @param name      NULL-terminated name, allocated with malloc().
+ * @return true     The element has the name.
+ * @return false    Out of memory, or the name is too long. The name has been freed.
+ */
+bool set_data_element_name_owned(named_data_t * element, char * name) {
+    bool status = false;
+    size_t name_len = strlen(name);
+
+#if !DATA_NAMES_INTERNED
+    if (name_len >= DATA_NAME_INLINE_SZ && name_len < DATA_NAME_REMOVED) {
+        name_arena_adopt(name_len + 1);
+        element->name_buf.long_name       = name;
+        element->name_buf.long_name_block = NULL;
+        element->name_len                 = (uint32_t)name_len;
+        element->name_hash                = data_name_hash(name, name_len);
+
+        /* The element owns the name now. */
+        name   = NULL;
+        status = true;
+        goto done;
+    }
+#endif
+
+    status = set_data_element_name_n(element, name, name_len);
+
+done:
+    free(name);
+
+    return status;
+}
+
+/**
+ * @brief Let go of an element's name.
+ *
+ * Long names are released back to their block of the name arena, which is
+ * freed once none of its names are in use. Adopted names are freed. Interned
+ * names drop their reference. Safe to call on a zeroed element.
+ *
+ * @param element   The element.
+ */
+void free_data_element_name(named_data_t * element) {
+#if DATA_NAMES_INTERNED
+    if (NULL != element->name_buf.long_name) {
+        release_interned_name(element->name_buf.long_name);
+    }
+    element->name_buf.long_name = NULL;
+#else
+    if (element->name_len >= DATA_NAME_INLINE_SZ) {
+        if (NULL != element->name_buf.long_name_block) {
+            name_arena_release(element->name_buf.long_name_block);
+        } else {
+            name_arena_disown(element->name_len + 1);
+            free((void *)element->name_buf.long_name);
+        }
+    }
+    element->name_buf.inline_name[0] = '\0';
+#endif
+    element->name_len  = 0;
+    element->name_hash = 0;
+}
+
+/**
+ * @brief Allocate the memory a new element will live in, if the slots hold
+ *        pointers to the elements.
+ *
+ * Appenders call this before they lock the shard, so that other appenders
+ * don't wait on the allocator, and pass the node to try_store_data_element()
+ * or store_data_element(). Free it with free() if neither stores it.
+ *
+ * @param[out] node     Set to the node. Set to NULL if the array is built with
+ *                      DATA_ARRAY_INLINE, since the slots hold the elements.
+ * @return true         Allocated, or no node is needed.
+ * @return false        Out of memory.
+ */
+bool alloc_data_node(named_data_t ** node) {
+#if DATA_ARRAY_INLINE
+    *node = NULL;
+    return true;
+#else
+    /* Allocate a new struct to put on our array. */
+    *node = malloc(sizeof(named_data_t));
+    return NULL != *node;
+#endif
+}
+
+/**
+ * @brief Store a new element at the end of a shard.
+ *
+ * The caller must hold the shard's lock, and should already have made room
+ * for the element, see install_data_segment(). If other appenders have used
+ * up that room in the meantime, the shard is grown again, under the lock.
+ * Nothing else is allocated under the lock, since the caller also brings the
+ * node to store the element in, see alloc_data_node().
+ *
+ * The shard must be the one data_array_shard() picks for the element's name.
+ * The element is copied into the shard, and its name's hash and length are
+ * recorded in the segment's columns. It's indexed by name the next time it's
+ * looked up.
+ *
+ * On success the array owns the element's name and the node. On failure the
+ * caller still owns them.
+ *
+ * @param shard         Shard to store the element in.
+ * @param element       Element to store.
+ * @param node          Memory for the element, from alloc_data_node().
+ * @param[out] handle   Optional. Set to the element's handle, see get_data_element().
+ * @return true         Element stored.
+ * @return false        Out of memory, or the array is frozen.
+ */
+bool store_data_element(data_shard_t * shard, const named_data_t * element, named_data_t * node,
+                        data_handle_t * handle) {
+    bool status = false;
+    size_t index;
+
+    if (data_array_frozen()) {
+        /* No appends until the array is unfrozen! */
+        goto done;
+    }
+
+    while (false == reserve_data_slot(shard, &index)) {
+        if (0 != (atomic_load(&shard->num_reserved) & DATA_SHARD_CLOSED) ||
+            false == grow_data_shard(shard)) {
+            /* Shard is closed, or can't grow! */
+            goto done;
+        }
+    }
+    publish_data_slot(shard, index, element, node);
+    if (NULL != handle) {
+        *handle = make_data_handle(shard, index);
+    }
+
+    /* Success! */
+    status = true;
+
+done:
+    return status;
+}
+
+/**
+ * @brief Allocate the nodes for a shard's share of a batch, before locking it.
+ *
+ * @param nodes         Where to put the nodes. NULL if there was no memory for
+ *                      them, or if the array is built with DATA_ARRAY_INLINE.
+ * @param num_nodes     Number of nodes needed.
+ * @return size_t       Number of elements there's memory for. Fewer than
+ *                      num_nodes if we ran out.
+ */
+static size_t alloc_data_nodes(named_data_t ** nodes, size_t num_nodes) {
+#if DATA_ARRAY_INLINE
+    /* The slots hold the elements, so they need no nodes. */
+    (void)nodes;
+    return num_nodes;
+#else
+    size_t i;
+
+    if (NULL == nodes) {
+        /* Out of memory! */
+        return 0;
+    }
+
+    for (i = 0; i < num_nodes; i++) {
+        if (false == alloc_data_node(&nodes[i])) {
+            /* Out of memory! */
+            break;
+        }
+    }
+
+    return i;
+#endif
+}
+
+/**
+ * @brief Store a batch of new elements, locking each shard they go in once.
+ *
+ * Before locking a shard, every segment it needs to take its share of the
+ * batch is allocated, so it grows at most once, see install_data_segment().
+ * Only if other appenders use up that room in the meantime does the shard grow
+ * again under the lock. The nodes the elements are stored in are allocated
+ * before the lock too, see alloc_data_node(). Elements that go in the same shard are stored in the
+ * order they're given.
+ *
+ * If a shard can't take one of its elements, that element and the ones after
+ * it for the same shard aren't stored. They're slid down to the front of the
+ * batch, in order, and the caller still owns their names.
+ *
+ * @param elements      The elements.
+ * @param num_elements  Number of elements in the batch.
+ * @param[out] stored   Optional. Set to whether each element was stored, in the order given.
+ * @return size_t       Number of elements that weren't stored, 0 if they all were.
+ */
+size_t store_data_elements(named_data_t * elements, size_t num_elements, bool * stored) {
+    size_t num_pending[DATA_ARRAY_NUM_SHARDS] = {0};
+    size_t first_pending[DATA_ARRAY_NUM_SHARDS];
+    size_t first_kept[DATA_ARRAY_NUM_SHARDS];
+    size_t max_pending = 0;
+    size_t num_kept    = 0;
+    named_data_t ** nodes = NULL;
+    size_t s;
+    size_t i;
+
+    init_data_shards();
+
+    for (i = num_elements; i > 0; i--) {
+        s = data_shard_number(elements[i - 1].name_hash);
+        num_pending[s] += 1;
+        first_pending[s] = i - 1;
+        if (num_pending[s] > max_pending) {
+            max_pending = num_pending[s];
+        }
+    }
+
+#if !DATA_ARRAY_INLINE
+    /* Room for the nodes of the biggest share. If there's none, nothing is stored. */
+    if (0 != max_pending) {
+        nodes = malloc(max_pending * sizeof(named_data_t *));
+    }
+#endif
+
+    for (s = 0; s < DATA_ARRAY_NUM_SHARDS; s++) {
+        data_shard_t * shard = &g_data_shards[s];
+        data_slot_t * new_segments[ARRAY_MAX_SEGMENTS];
+        size_t first_segment;
+        size_t num_new_segments = 0;
+        size_t num_nodes;
+        size_t num_used = 0;
+        size_t room;
+
+        first_kept[s] = num_elements;
+        if (0 == num_pending[s]) {
+            continue;
+        }
+
+        /* Make the segments the shard needs for its share before we lock it. */
+        room          = data_shard_room(shard);
+        first_segment = data_shard_next_segment(shard);
+        while (room < num_pending[s] && first_segment + num_new_segments < ARRAY_MAX_SEGMENTS) {
+            size_t segment = first_segment + num_new_segments;
+
+            new_segments[num_new_segments] = calloc(1, ARRAY_SEGMENT_BYTES(segment));
+            if (NULL == new_segments[num_new_segments]) {
+                /* Out of memory! The shard will try again under the lock. */
+                break;
+            }
+            room += ARRAY_SEGMENT_SIZE(segment);
+            num_new_segments += 1;
+        }
+
+        /* ...and the nodes its elements go in. */
+        num_nodes = alloc_data_nodes(nodes, num_pending[s]);
+
+        /* Lock the shard once for every element in the batch that goes in it. */
+        data_lock_acquire(&shard->lock);
+
+        for (i = 0; i < num_new_segments; i++) {
+            if (false == install_data_segment(shard, first_segment + i, new_segments[i])) {
+                /* Someone else grew the shard first, so we don't need the rest. */
+                break;
+            }
+            /* The shard owns this segment now. */
+            new_segments[i] = NULL;
+        }
+
+        for (i = first_pending[s]; 0 < num_pending[s]; i++) {
+            if (s != data_shard_number(elements[i].name_hash)) {
+                continue;
+            }
+            num_pending[s] -= 1;
+
+            if (num_used == num_nodes ||
+                false == store_data_element(shard, &elements[i], NULL != nodes ? nodes[num_used] : NULL, NULL)) {
+                /* Out of memory, or frozen! Keep the rest of this shard's elements. */
+                first_kept[s] = i;
+                break;
+            }
+            num_used += 1;
+        }
+
+        /* Unlock the shard so other threads can access it once more. */
+        data_lock_release(&shard->lock);
+
+        for (i = 0; i < num_new_segments; i++) {
+            free(new_segments[i]);
+        }
+        for (i = num_used; NULL != nodes && i < num_nodes; i++) {
+            free(nodes[i]);
+        }
+    }
+
+    free(nodes);
+
+    /* Slide the elements we kept down to the front of the batch. */
+    for (i = 0; i < num_elements; i++) {
+        bool kept = i >= first_kept[data_shard_number(elements[i].name_hash)];
+
+        if (NULL != stored) {
+            stored[i] = false == kept;
+        }
+        if (true == kept) {
+            elements[num_kept++] = elements[i];
+        }
+    }
+
+    return num_kept;
+}
+
+/**
+ * @brief Store a new element at the end of a shard, without locking it.
+ *
+ * This only works in DATA_ARRAY_LOCK_FREE builds, and only while the shard
+ * has room. Otherwise the caller should lock the shard, make room, and use
+ * store_data_element() instead.
+ *
+ * On success the array owns the element's name and the node. On failure the
+ * caller still owns them, and can pass them on to store_data_element().
+ *
+ * @param shard         Shard to store the element in.
+ * @param element       Element to store.
+ * @param node          Memory for the element, from alloc_data_node().
+ * @param[out] handle   Optional. Set to the element's handle, see get_data_element().
+ * @return true         Element stored.
+ * @return false        The shard is full, or the array is frozen.
+ */
+bool try_store_data_element(data_shard_t * shard, const named_data_t * element, named_data_t * node,
+                            data_handle_t * handle) {
+#if DATA_ARRAY_LOCK_FREE
+    bool status = false;
+    size_t index;
+
+    if (false == reserve_data_slot(shard, &index)) {
+        /* No room, or the array is frozen. */
+        goto done;
+    }
+    publish_data_slot(shard, index, element, node);
+    if (NULL != handle) {
+        *handle = make_data_handle(shard, index);
+    }
+
+    /* Success! */
+    status = true;
+
+done:
+    return status;
+#else
+    (void)shard;
+    (void)element;
+    (void)node;
+    (void)handle;
+    return false;
+#endif
+}
+
+/**
+ * @brief Add a batch of new named data elements to the global array.
+ *
+ * Like calling append_data_element() for each of them in turn, but every
+ * shard the batch goes in is grown at most once, and locked once. With one
+ * shard, that's a single lock acquisition for the whole batch.
+ *
+ * Elements with a NULL name or data are skipped. If a shard can't take one
+ * of its elements, the ones after it for the same shard aren't added either,
+ * so that each shard keeps them in order.
+ *
+ * @param names         NULL-terminated name of each element.
+ * @param datas         Pointer to the data of each element. We're given ownership of the data of those added.
+ * @param num_elements  Number of elements in the batch.
+ * @param[out] added    Optional. Set to whether each element was added.
+ * @return size_t       Number of elements added.
+ */
+size_t append_data_elements(const char * const * names, void * const * datas, size_t num_elements, bool * added) {
+    size_t num_added = 0;
+    named_data_t * elements = NULL;
+    size_t * positions = NULL;   /* Where each element we made is in the batch */
+    bool * stored = NULL;
+    size_t num_made = 0;
+    size_t num_kept;
+    size_t i;
+
+    if (NULL != added) {
+        memset(added, 0, num_elements * sizeof(bool));
+    }
+
+    if (NULL == names || NULL == datas || 0 == num_elements) {
+        /* Bad args, or nothing to do. */
+        goto done;
+    }
+
+    if (data_array_frozen()) {
+        /* No appends until the array is unfrozen! */
+        goto done;
+    }
+
+    elements  = malloc(num_elements * sizeof(named_data_t));
+    positions = malloc(num_elements * sizeof(size_t));
+    stored    = malloc(num_elements * sizeof(bool));
+    if (NULL == elements || NULL == positions || NULL == stored) {
+        /* Out of memory! */
+        goto done;
+    }
+
+    for (i = 0; i < num_elements; i++) {
+        named_data_t * element = &elements[num_made];
+
+        if (NULL == names[i] || NULL == datas[i]) {
+            /* Bad args! */
+            continue;
+        }
+
+        /* We don't own the name, so let's copy it. */
+        memset(element, 0, sizeof(named_data_t));
+        if (false == set_data_element_name(element, names[i])) {
+            /* Out of memory! */
+            continue;
+        }
+
+        /* We're given ownership of the data, so we'll assign the pointer. */
+        element->data = datas[i];
+
+        positions[num_made++] = i;
+    }
+
+    /* The elements that weren't stored end up at the front, and we still own their names. */
+    num_kept = store_data_elements(elements, num_made, stored);
+    for (i = 0; i < num_kept; i++) {
+        free_data_element_name(&elements[i]);
+    }
+
+    for (i = 0; i < num_made; i++) {
+        if (true == stored[i]) {
+            if (NULL != added) {
+                added[positions[i]] = true;
+            }
+            num_added += 1;
+        }
+    }
+
+done:
+    free(stored);
+    free(positions);
+    free(elements);
+
+    return num_added;
+}
+
+/**
+ * @brief Add a new named data element to the global array, taking its name.
+ *
+ * Like append_data_element(), except that the name is handed over instead of
+ * copied, which saves copying long names. The name must have been allocated
+ * with malloc(), and is ours even if this fails. It's freed with free() once
+ * the element is removed, or the array is freed, or straight away if this
+ * fails. See set_data_element_name_owned(). teardown_data_array() with
+ * skip_element_frees leaks the name, along with its element, and the name
+ * arena goes on counting it.
+ *
+ * @param name      NULL-terminated element name, allocated with malloc()
+ * @param data      Pointer to the element data
+ * @return true     Element successfully added.
+ * @return false    Failed to add element.
+ */
+bool append_data_element_owned(char * name, void * data) {
+    bool status = false;
+    named_data_t new_element = {0};
+#if DATA_ARRAY_LOCK_FREE
+    named_data_t * node;
+    data_shard_t * shard;
+#endif
+
+    if (NULL == name || NULL == data) {
+        /* Bad args! */
+        free(name);
+        goto done;
+    }
+
+    if (data_array_frozen()) {
+        /* No appends until the array is unfrozen! */
+        free(name);
+        goto done;
+    }
+
+    /* We own the name, so we can keep it rather than copy it. */
+    if (false == set_data_element_name_owned(&new_element, name)) {
+        /* Out of memory! */
+        goto done;
+    }
+
+    /* We're given ownership of the data, so we'll assign the pointer. */
+    new_element.data = data;
+
+#if DATA_ARRAY_LOCK_FREE
+    /* If the shard has room, we may not have to lock it at all. */
+    if (false == alloc_data_node(&node)) {
+        /* Out of memory! */
+        goto done;
+    }
+    shard = data_array_shard(new_element.name_hash);
+    if (true == try_store_data_element(shard, &new_element, node, NULL)) {
+        /* Success! */
+        status = true;
+        goto done;
+    }
+    free(node);
+#endif
+
+    /* Otherwise make room, and store it under the shard's lock. */
+    if (0 != store_data_elements(&new_element, 1, NULL)) {
+        /* Out of memory, or frozen! */
+        goto done;
+    }
+
+    /* Success! */
+    status = true;
+
+done:
+    if (false == status) {
+        free_data_element_name(&new_element);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Add a new named data element to the global array, and get its handle.
+ *
+ * Like append_data_element(), except that the name needn't be
+ * NULL-terminated, so it can be a slice of a bigger buffer, and the new
+ * element's handle is handed back, see get_data_element().
+ *
+ * @param name          Element name, which needn't be NULL-terminated
+ * @param name_len      Length of the name
+ * @param data          Pointer to the element data
+ * @param[out] handle   Optional. Set to the element's handle.
+ * @return true         Element successfully added.
+ * @return false        Failed to add element.
+ */
+bool append_data_element_handle(const char * name, size_t name_len, void * data, data_handle_t * handle) {
+    bool status = false;
+    named_data_t new_element = {0};
+    named_data_t * node = NULL;
+    data_shard_t * shard;
+
+    if (NULL == name || NULL == data) {
+        /* Bad args! */
+        goto done;
+    }
+
+    if (data_array_frozen()) {
+        /* No appends until the array is unfrozen! */
+        goto done;
+    }
+
+    /* We don't own the name, so let's copy it. */
+    if (false == set_data_element_name_n(&new_element, name, name_len)) {
+        /* Out of memory! */
+        goto done;
+    }
+
+    /* We're given ownership of the data, so we'll assign the pointer. */
+    new_element.data = data;
+
+    /* The array may keep the element in memory of its own. Allocate it before we lock anything. */
+    if (false == alloc_data_node(&node)) {
+        /* Out of memory! */
+        goto done;
+    }
+
+    /* If the shard has room, we may not have to lock it at all. */
+    shard = data_array_shard(new_element.name_hash);
+    if (true == try_store_data_element(shard, &new_element, node, handle)) {
+        /* Success! */
+        status = true;
+        goto done;
+    }
+
+    /* Lock the shard so we can safely add our new element, growing the shard if need be. */
+    data_lock_acquire(&shard->lock);
+
+    status = store_data_element(shard, &new_element, node, handle);
+
+    /* Unlock the shard so other threads can access it once more. */
+    data_lock_release(&shard->lock);
+
+done:
+    if (false == status) {
+        free(node);
+        free_data_element_name(&new_element);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Get the element a handle is for, in constant time.
+ *
+ * Takes no lock. If other threads may be removing elements or compacting the
+ * array, call this from inside a read section (see data_rcu.h), and only use
+ * the element until it ends.
+ *
+ * The handle goes through its shard's slot map, so it still finds the
+ * element after compaction has moved it.
+ *
+ * @param handle            Handle from when the element was added.
+ * @return named_data_t*    The element.
+ * @return NULL             The handle is stale: the element was removed, or
+ *                          the array has been freed since. Or it was never
+ *                          valid.
+ */
+named_data_t * get_data_element(data_handle_t handle) {
+    named_data_t * element = NULL;
+    data_shard_t * shard;
+    size_t index;
+
+    if (data_handle_shard(handle) >= DATA_ARRAY_NUM_SHARDS) {
+        /* Not a handle at all! */
+        return NULL;
+    }
+    shard = &g_data_shards[data_handle_shard(handle)];
+
+    /* Our own read section, so the element can't move while we find it. */
+    data_rcu_read_lock();
+
+    if (false == find_data_handle_slot(shard, handle, &index)) {
+        /* Stale! */
+        goto unlock;
+    }
+
+    element = data_shard_element(shard, index);
+
+unlock:
+    data_rcu_read_unlock();
+
+    return element;
+}
+
+/**
+ * @brief Visit every element in the global data array with the given name.
+ *
+ * Unlike lookup_data_element(), this finds every element with the name, in
+ * the order they were added. Those are all in the same shard, so it walks the
+ * hash and length columns of each segment in that one shard, and only touches
+ * the elements whose hash and length both match.
+ *
+ * No lock is taken. Segments never move once they're added, so the walk only
+ * has to stop at the elements that were published when it started. Elements
+ * added while it runs, including by the visitor, may or may not be visited.
+ * The walk is a read section (see data_rcu.h), so an element can't be freed
+ * while the visitor has it, even if another thread removes it.
+ *
+ * @param name      Element name.
+ * @param visitor   Called for each matching element.
+ * @param ctx       Passed through to the visitor.
+ * @return size_t   Number of elements visited.
+ */
+size_t scan_data_elements_by_name(const char * name, data_element_visitor_t visitor, void * ctx) {
+    size_t num_visited = 0;
+    data_shard_t * shard;
+    size_t num_elements;
+    size_t name_len;
+    uint32_t hash;
+    size_t segment;
+    size_t base;
+
+    if (NULL == name || NULL == visitor) {
+        /* Bad args! */
+        return 0;
+    }
+
+    name_len = strlen(name);
+    if (name_len >= DATA_NAME_REMOVED) {
+        /* No element has a name this long. */
+        return 0;
+    }
+    hash  = data_name_hash(name, name_len);
+    shard = data_array_shard(hash);
+
+    data_rcu_read_lock();
+
+    num_elements = atomic_load_explicit(&shard->num_elements, memory_order_acquire);
+    for (segment = 0, base = 0;
+         base < num_elements;
+         base += ARRAY_SEGMENT_SIZE(segment), segment++) {
+        const uint32_t * hashes            = data_segment_hashes(shard, segment);
+        const _Atomic uint32_t * name_lens = data_segment_name_lens(shard, segment);
+        size_t count  = num_elements - base;
+        size_t offset;
+
+        if (count > ARRAY_SEGMENT_SIZE(segment)) {
+            count = ARRAY_SEGMENT_SIZE(segment);
+        }
+
+        for (offset = 0; offset < count; offset++) {
+            named_data_t * element;
+
+            /* Removed elements never match, since no name is that long. */
+            if (hash != hashes[offset] ||
+                name_len != atomic_load_explicit(&name_lens[offset], memory_order_relaxed)) {
+                continue;
+            }
+
+            element = data_shard_element(shard, base + offset);
+            if (0 != memcmp(data_element_name(element), name, name_len)) {
+                /* Hash collision */
+                continue;
+            }
+
+            num_visited += 1;
+            if (false == visitor(element, ctx)) {
+                goto unlock;
+            }
+        }
+    }
+
+unlock:
+    data_rcu_read_unlock();
+
+    return num_visited;
+}
+
+/**
+ * @brief Hand a chunk of elements to a visitor.
+ *
+ * @param visitor           Called with the chunk.
+ * @param ctx               Passed through to the visitor.
+ * @param chunk             The elements.
+ * @param num_chunked       Number of elements in the chunk.
+ * @param[in,out] num_visited   Number of elements visited so far.
+ * @return true             Keep scanning.
+ * @return false            The visitor stopped the scan.
+ */
+static bool visit_data_chunk(
+    data_chunk_visitor_t visitor,
+    void * ctx,
+    named_data_t * const * chunk,
+    size_t num_chunked,
+    size_t * num_visited)
+{
+    *num_visited += num_chunked;
+    return visitor(chunk, num_chunked, ctx);
+}
+
+/* The element a chunk ahead is at most one segment further on. */
+_Static_assert(DATA_SCAN_CHUNK_SZ <= ARRAY_BLK_SZ, "Scan chunks must fit in the first segment");
+
+/**
+ * @brief Visit every element in the global data array, a chunk at a time.
+ *
+ * Walks each shard's segments in order, skipping removed elements, and hands
+ * the visitor up to DATA_SCAN_CHUNK_SZ elements at a time. While a chunk is
+ * being filled, the elements of the next one are fetched into the cache, and
+ * each element's long name is fetched as the element is added to the chunk,
+ * well before the visitor reads it. So a scan doesn't stall on each element
+ * in turn, the way following every slot's pointer one by one does.
+ *
+ * No lock is taken, the same as for scan_data_elements_by_name(): each shard
+ * is walked up to the elements that were published when the walk reached it,
+ * and the walk is a read section (see data_rcu.h), so no element is freed
+ * while the visitor has it. Elements added while it runs may or may not be
+ * visited. Elements with the same name are visited in the order they were
+ * added, but elements in different shards aren't.
+ *
+ * @param visitor   Called for each chunk of elements.
+ * @param ctx       Passed through to the visitor.
+ * @return size_t   Number of elements visited.
+ */
+size_t for_each_data_element(data_chunk_visitor_t visitor, void * ctx) {
+    named_data_t * chunk[DATA_SCAN_CHUNK_SZ];
+    size_t num_chunked = 0;
+    size_t num_visited = 0;
+    size_t s;
+
+    if (NULL == visitor) {
+        /* Bad args! */
+        return 0;
+    }
+
+    data_rcu_read_lock();
+
+    for (s = 0; s < DATA_ARRAY_NUM_SHARDS; s++) {
+        data_shard_t * shard = &g_data_shards[s];
+        size_t num_elements  = atomic_load_explicit(&shard->num_elements, memory_order_acquire);
+        size_t segment;
+        size_t base;
+
+        for (segment = 0, base = 0;
+             base < num_elements;
+             base += ARRAY_SEGMENT_SIZE(segment), segment++) {
+            data_slot_t * slots                = shard->segments[segment];
+            const _Atomic uint32_t * name_lens = data_segment_name_lens(shard, segment);
+            size_t count = num_elements - base;
+            size_t offset;
+
+            if (count > ARRAY_SEGMENT_SIZE(segment)) {
+                count = ARRAY_SEGMENT_SIZE(segment);
+            }
+
+            for (offset = 0; offset < count; offset++) {
+#if DATA_ARRAY_INLINE
+                /* The slots are read in order, so the hardware fetches them ahead by itself. */
+                chunk[num_chunked] = &slots[offset];
+#else
+                /* ...but not the elements they point to, so fetch those a chunk ahead, even past this segment. */
+                if (base + offset + DATA_SCAN_CHUNK_SZ < num_elements) {
+                    if (offset + DATA_SCAN_CHUNK_SZ < ARRAY_SEGMENT_SIZE(segment)) {
+                        data_prefetch(slots[offset + DATA_SCAN_CHUNK_SZ]);
+                    } else {
+                        data_prefetch(shard->segments[segment + 1][offset + DATA_SCAN_CHUNK_SZ -
+                                                                   ARRAY_SEGMENT_SIZE(segment)]);
+                    }
+                }
+                chunk[num_chunked] = slots[offset];
+#endif
+                if (DATA_NAME_REMOVED == atomic_load_explicit(&name_lens[offset], memory_order_relaxed)) {
+                    continue;
+                }
+
+                /* The visitor won't get to the name until the chunk is full, so it has time to arrive. */
+                if (DATA_NAMES_INTERNED || chunk[num_chunked]->name_len >= DATA_NAME_INLINE_SZ) {
+                    data_prefetch(chunk[num_chunked]->name_buf.long_name);
+                }
+
+                num_chunked += 1;
+                if (DATA_SCAN_CHUNK_SZ == num_chunked) {
+                    num_chunked = 0;
+                    if (false == visit_data_chunk(visitor, ctx, chunk, DATA_SCAN_CHUNK_SZ, &num_visited)) {
+                        goto unlock;
+                    }
+                }
+            }
+        }
+    }
+
+    if (0 != num_chunked) {
+        (void)visit_data_chunk(visitor, ctx, chunk, num_chunked, &num_visited);
+    }
+
+unlock:
+    data_rcu_read_unlock();
+
+    return num_visited;
+}
+
+/**
+ * @brief Find the first element in part of a shard with the given name.
+ *
+ * Checks the elements one by one. The caller must hold the shard's lock, or
+ * be in a read section (see data_rcu.h).
+ *
+ * @param shard     The shard.
+ * @param name      Element name.
+ * @param name_len  Length of the name.
+ * @param hash      Hash of the name.
+ * @param start     Index of the first element to check.
+ * @param end       Index to stop at, at most shard->num_elements.
+ * @return size_t   Index of the element, or `end` if none of them has the name.
+ */
+size_t find_data_element(
+    const data_shard_t * shard,
+    const char * name,
+    size_t name_len,
+    uint32_t hash,
+    size_t start,
+    size_t end)
+{
+    size_t index;
+
+    for (index = start; index < end; index++) {
+        size_t offset;
+        size_t segment = data_array_locate(index, &offset);
+
+        if (hash == data_segment_hashes(shard, segment)[offset] &&
+            name_len == atomic_load_explicit(&data_segment_name_lens(shard, segment)[offset],
+                                             memory_order_relaxed) &&
+            0 == memcmp(data_element_name(data_shard_element(shard, index)), name, name_len)) {
+            break;
+        }
+    }
+
+    return index;
+}
+
+/**
+ * @brief Free a removed element, once no reader can be using it.
+ *
+ * @param ptr   The element, in its own allocation. Or if the element lives in
+ *              the array itself, its interned name, or the arena block its
+ *              long name is in.
+ */
+static void free_removed_data_element(void * ptr) {
+#if DATA_ARRAY_INLINE && DATA_NAMES_INTERNED
+    release_interned_name(ptr);
+#elif DATA_ARRAY_INLINE
+    name_arena_release(ptr);
+#else
+    free_data_element_name(ptr);
+    free(ptr);
+#endif
+}
+
+/**
+ * @brief Mark an element in a shard as removed, and retire it.
+ *
+ * The caller must hold the shard's lock.
+ *
+ * @param shard         The shard.
+ * @param index         Index of the element, which must not be removed already.
+ * @param next_element  The next element added with the same name, if lookups
+ *                      could find this one in the index. Otherwise NULL.
+ * @param next_index    Index of the next element, if there is one.
+ */
+static void remove_data_slot(data_shard_t * shard, size_t index, named_data_t * next_element, size_t next_index) {
+    named_data_t * element = data_shard_element(shard, index);
+    size_t offset;
+    size_t segment = data_array_locate(index, &offset);
+
+    atomic_store_explicit(&data_segment_name_lens(shard, segment)[offset], DATA_NAME_REMOVED, memory_order_relaxed);
+    atomic_fetch_add(&shard->num_removed, 1);
+
+    /* Handles to the element are stale now. */
+    retire_data_entry(shard, data_slot_entry(shard, index));
+
+    data_index_remove(shard, element, next_element, next_index);
+
+#if DATA_ARRAY_INLINE
+    /* The element stays in its slot, but its name can go. */
+    if (DATA_NAMES_INTERNED) {
+        data_rcu_retire((void *)element->name_buf.long_name, free_removed_data_element);
+    } else if (element->name_len >= DATA_NAME_INLINE_SZ && NULL != element->name_buf.long_name_block) {
+        data_rcu_retire(element->name_buf.long_name_block, free_removed_data_element);
+    } else if (element->name_len >= DATA_NAME_INLINE_SZ) {
+        /* It was adopted, so it's the element's to free. */
+        name_arena_disown(element->name_len + 1);
+        data_rcu_retire((void *)element->name_buf.long_name, free);
+    }
+#else
+    data_rcu_retire(element, free_removed_data_element);
+#endif
+}
+
+/**
+ * @brief Remove an element from the global data array.
+ *
+ * Removes the first element added with the name, the one lookup_data_element()
+ * finds. After that, lookups find the next element added with the name, if
+ * there is one.
+ *
+ * The element is found through the shard's index, which is brought up to date
+ * first, so removing doesn't search the shard. Only a name that other
+ * elements share takes a search, from the element on, for the next one.
+ *
+ * The element's slot is marked as removed, so readers skip it from then on.
+ * Readers that already have the element may keep using it until they leave
+ * their read section (see data_rcu.h). Then it's freed, along with its name,
+ * if nothing else is using that.
+ *
+ * @param name      Element name.
+ * @return true     Element removed.
+ * @return false    No element has that name, or the array is frozen.
+ */
+bool remove_data_element(const char * name) {
+    bool status = false;
+    data_shard_t * shard;
+    named_data_t * element;
+    named_data_t * next_element = NULL;
+    size_t num_elements;
+    size_t name_len;
+    uint32_t hash;
+    size_t index;
+    size_t next_index = 0;
+
+    if (NULL == name) {
+        /* Bad args! */
+        return false;
+    }
+
+    name_len = strlen(name);
+    if (name_len >= DATA_NAME_REMOVED) {
+        /* No element has a name this long. */
+        return false;
+    }
+    hash  = data_name_hash(name, name_len);
+    shard = data_array_shard(hash);
+
+    /* Lock the shard so nobody else removes the element, or indexes it. */
+    data_lock_acquire(&shard->lock);
+
+    if (data_array_frozen()) {
+        /* No removals until the array is unfrozen! */
+        goto unlock;
+    }
+
+    /* The index says where the element is. */
+    if (false == data_index_find(shard, name, name_len, hash, &index)) {
+        /* No element has that name. */
+        goto unlock;
+    }
+    element = data_shard_element(shard, index);
+
+    if (true == data_index_has_duplicates(shard, element)) {
+        /* Lookups will find the next element with the name instead. */
+        num_elements = atomic_load_explicit(&shard->num_elements, memory_order_acquire);
+        next_index   = find_data_element(shard, name, name_len, hash, index + 1, num_elements);
+        if (next_index < num_elements) {
+            next_element = data_shard_element(shard, next_index);
+        }
+    }
+
+    remove_data_slot(shard, index, next_element, next_index);
+
+    status = true;
+
+unlock:
+    /* Unlock the shard so other threads can access it once more. */
+    data_lock_release(&shard->lock);
+
+    return status;
+}
+
+/**
+ * @brief Remove the element a handle is for from the global data array.
+ *
+ * The handle says where the element is, so unlike remove_data_element(), this
+ * doesn't look its name up in the index. Otherwise it's the same: the slot is marked
+ * as removed, the element is freed once no reader can be using it, and lookups
+ * find the next element added with the name, if there is one. Only finding
+ * that one takes a search, and only if other elements with the name have been
+ * indexed.
+ *
+ * @param handle    Handle from when the element was added.
+ * @return true     Element removed.
+ * @return false    The handle is stale, or the array is frozen.
+ */
+bool remove_data_element_by_handle(data_handle_t handle) {
+    bool status = false;
+    data_shard_t * shard;
+    named_data_t * element;
+    named_data_t * next_element = NULL;
+    size_t num_elements;
+    size_t index;
+    size_t next_index = 0;
+
+    if (data_handle_shard(handle) >= DATA_ARRAY_NUM_SHARDS) {
+        /* Not a handle at all! */
+        return false;
+    }
+
+    init_data_shards();
+    shard = &g_data_shards[data_handle_shard(handle)];
+
+    /* Lock the shard so nobody else removes the element, or moves it. */
+    data_lock_acquire(&shard->lock);
+
+    if (data_array_frozen()) {
+        /* No removals until the array is unfrozen! */
+        goto unlock;
+    }
+
+    num_elements = atomic_load_explicit(&shard->num_elements, memory_order_acquire);
+    if (false == find_data_handle_slot(shard, handle, &index)) {
+        /* Stale, the element is gone already. */
+        goto unlock;
+    }
+    element = data_shard_element(shard, index);
+
+    if (true == data_index_has_duplicates(shard, element)) {
+        /* Lookups will find the next element with the name instead. */
+        next_index = find_data_element(shard, data_element_name(element), element->name_len, element->name_hash,
+                                       index + 1, num_elements);
+        if (next_index < num_elements) {
+            next_element = data_shard_element(shard, next_index);
+        }
+    }
+
+    remove_data_slot(shard, index, next_element, next_index);
+
+    status = true;
+
+unlock:
+    /* Unlock the shard so other threads can access it once more. */
+    data_lock_release(&shard->lock);
+
+    return status;
+}
+
+/**
+ * @brief Start a new generation of the array, past every generation an entry
+ *        has had, so every handle so far is stale.
+ *
+ * The caller must have locked every shard with lock_data_shards().
+ */
+static void start_data_array_generation(void) {
+    uint32_t generation     = atomic_load(&g_data_array_generation);
+    uint32_t max_generation = atomic_load(&g_data_entry_max_generation);
+
+    generation = next_data_generation(max_generation > generation ? max_generation : generation);
+    atomic_store(&g_data_array_generation, generation);
+    atomic_store(&g_data_entry_max_generation, generation);
+}
+
+/**
+ * @brief Move an element from one slot of a shard to another, with its columns.
+ *
+ * The slot it moves to must be empty. The two slots swap slot map entries, so
+ * the element's entry goes with it, and the empty slot's goes to the one the
+ * element left.
+ *
+ * @param shard     The shard, locked by close_data_shard().
+ * @param from      Index of the element.
+ * @param to        Index of the slot to move it to.
+ */
+static void move_data_slot(data_shard_t * shard, size_t from, size_t to) {
+    size_t from_offset;
+    size_t from_segment = data_array_locate(from, &from_offset);
+    size_t to_offset;
+    size_t to_segment = data_array_locate(to, &to_offset);
+    size_t from_entry   = data_slot_entry(shard, from);
+    size_t to_entry     = data_slot_entry(shard, to);
+
+    shard->segments[to_segment][to_offset]            = shard->segments[from_segment][from_offset];
+    data_segment_hashes(shard, to_segment)[to_offset] = data_segment_hashes(shard, from_segment)[from_offset];
+    atomic_store_explicit(&data_segment_name_lens(shard, to_segment)[to_offset],
+                          atomic_load_explicit(&data_segment_name_lens(shard, from_segment)[from_offset],
+                                               memory_order_relaxed),
+                          memory_order_relaxed);
+
+    map_data_slot_entry(shard, to, from_entry);
+    map_data_slot_entry(shard, from, to_entry);
+}
+
+/**
+ * @brief Move the elements of a shard into the slots of the removed ones.
+ *
+ * @param shard     The shard, locked by close_data_shard().
+ * @param order     Whether the elements must stay in the order they were added.
+ * @return size_t   Number of removed elements whose slots were reclaimed.
+ */
+static size_t compact_data_shard(data_shard_t * shard, data_compact_order_t order) {
+    size_t num_elements = atomic_load_explicit(&shard->num_elements, memory_order_relaxed);
+    size_t num_kept     = 0;
+    size_t i;
+
+    if (0 == atomic_load_explicit(&shard->num_removed, memory_order_relaxed)) {
+        /* Nothing to reclaim. */
+        return 0;
+    }
+
+    if (DATA_COMPACT_KEEP_ORDER == order) {
+        /* Slide each element down over the holes before it. */
+        for (i = 0; i < num_elements; i++) {
+            if (false == data_shard_removed(shard, i)) {
+                if (num_kept != i) {
+                    move_data_slot(shard, i, num_kept);
+                }
+                num_kept += 1;
+            }
+        }
+    } else {
+        /* Fill each hole with the last element, so only as many move as there are holes. */
+        num_kept = num_elements;
+        for (i = 0; i < num_kept; i++) {
+            if (false == data_shard_removed(shard, i)) {
+                continue;
+            }
+            while (num_kept > i + 1 && true == data_shard_removed(shard, num_kept - 1)) {
+                num_kept -= 1;
+            }
+            num_kept -= 1;
+            if (num_kept > i) {
+                move_data_slot(shard, num_kept, i);
+            }
+        }
+    }
+
+#if DATA_ARRAY_LOCK_FREE
+    /* Appenders will fill the emptied slots in again, so they mustn't look ready. */
+    for (i = num_kept; i < num_elements; i++) {
+        size_t offset;
+        size_t segment = data_array_locate(i, &offset);
+
+        atomic_store(&data_segment_ready(shard, segment)[offset], 0);
+    }
+#endif
+
+    /* Zero the removed count first, so data_array_count() never sees it above num_elements. */
+    atomic_store(&shard->num_removed, 0);
+    atomic_store(&shard->num_elements, num_kept);
+    atomic_store(&shard->num_reserved, num_kept | DATA_SHARD_CLOSED); /* Reopened when we unlock */
+
+    /* The index has counted slots whose elements have moved. Lookups will rebuild it. */
+    data_index_clear(shard);
+
+    return num_elements - num_kept;
+}
+
+/**
+ * @brief Compact the global data array, so the slots of removed elements can
+ *        be used again.
+ *
+ * Removing an element only marks its slot, so that readers, who take no lock,
+ * never see an element move. With enough churn, the marked slots add up.
+ * Compacting moves the elements that are left into them, either keeping them
+ * in the order they were added, or filling each hole with the last element in
+ * its shard, which moves far fewer of them. The room freed up at the end of
+ * each shard goes to later appends. No segment is freed.
+ *
+ * This is a maintenance pass, for a quiet moment once get_data_array_stats()
+ * shows that enough elements have been removed. It goes one shard at a time,
+ * and skips shards with nothing to reclaim. While a shard's elements move,
+ * that shard is locked, and readers are shut out (see
+ * data_rcu_exclude_readers()). Lookups and scans that start meanwhile wait for
+ * the shard to finish, and it waits for the ones already running, so no
+ * reader ever sees an element half moved. A read section isn't tied to a
+ * shard, so every reader waits, but only for one shard's worth of moves at a
+ * time. Appenders and removers only wait if they need the shard being
+ * compacted.
+ *
+ * Elements found before, even by handle, may have moved afterwards, the same
+ * as if they had been removed, so they're only safe to use until the read
+ * section they were found in ends. Handles stay valid, since each shard's slot
+ * map moves with its elements. With DATA_COMPACT_ANY_ORDER, which element
+ * lookup_data_element() finds for a name that repeats may change.
+ *
+ * @param order     Whether the elements must stay in the order they were added.
+ * @return size_t   Number of removed elements whose slots were reclaimed. 0 if
+ *                  the array is frozen, or this was called from inside a read
+ *                  section.
+ */
+size_t compact_data_array(data_compact_order_t order) {
+    size_t num_reclaimed = 0;
+    bool frozen = false;
+    size_t s;
+
+    init_data_shards();
+
+    for (s = 0; s < DATA_ARRAY_NUM_SHARDS && false == frozen; s++) {
+        data_shard_t * shard = &g_data_shards[s];
+
+        if (0 == atomic_load_explicit(&shard->num_removed, memory_order_relaxed)) {
+            /* Nothing to reclaim, so don't hold anybody up. */
+            continue;
+        }
+
+        /* Shut readers out, so nobody looks at an element while it moves. */
+        if (false == data_rcu_exclude_readers()) {
+            /* Called from inside a read section! */
+            break;
+        }
+
+        /* Lock the shard so nobody appends or removes elements in it while they move. */
+        close_data_shard(shard);
+
+        /* Freezing locks every shard, so this can't change while we hold one. */
+        frozen = data_array_frozen();
+        if (false == frozen) {
+            num_reclaimed += compact_data_shard(shard, order);
+        }
+
+        /* Unlock the shard so other threads can access it once more. */
+        reopen_data_shard(shard, frozen);
+        data_rcu_admit_readers();
+    }
+
+    return num_reclaimed;
+}
+
+/**
+ * @brief Count the elements in the global data array.
+ *
+ * Takes no lock. Compaction and teardown shrink a shard's num_elements while
+ * this may be running. They zero num_removed first, and this reads num_removed
+ * first, but the two reads still needn't be from the same moment. So a shard
+ * whose removed count looks bigger than its element count counts as empty,
+ * rather than wrapping around.
+ *
+ * @return size_t   Number of elements in every shard, not counting removed ones.
+ */
+size_t data_array_count(void) {
+    size_t count = 0;
+    size_t i;
+
+    init_data_shards();
+
+    for (i = 0; i < DATA_ARRAY_NUM_SHARDS; i++) {
+        size_t num_removed  = atomic_load_explicit(&g_data_shards[i].num_removed, memory_order_acquire);
+        size_t num_elements = atomic_load_explicit(&g_data_shards[i].num_elements, memory_order_acquire);
+
+        if (num_elements > num_removed) {
+            count += num_elements - num_removed;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Count the slots the global data array has used up.
+ *
+ * Unlike data_array_count(), this counts the slots of removed elements too,
+ * since they aren't used again until the array is compacted. Takes no lock.
+ *
+ * @return size_t   Number of slots used in every shard.
+ */
+size_t data_array_used_slots(void) {
+    size_t used = 0;
+    size_t i;
+
+    init_data_shards();
+
+    for (i = 0; i < DATA_ARRAY_NUM_SHARDS; i++) {
+        used += atomic_load_explicit(&g_data_shards[i].num_elements, memory_order_relaxed);
+    }
+
+    return used;
+}
+
+/**
+ * @brief Find how many elements the global data array can hold without growing.
+ *
+ * @return size_t   Size of every shard (in elements).
+ */
+size_t data_array_capacity(void) {
+    size_t capacity = 0;
+    size_t i;
+
+    init_data_shards();
+
+    for (i = 0; i < DATA_ARRAY_NUM_SHARDS; i++) {
+        capacity += atomic_load_explicit(&g_data_shards[i].size, memory_order_relaxed);
+    }
+
+    return capacity;
+}
+
+/**
+ * @brief Get the size of the global data array, and how much it has grown.
+ *
+ * Takes no lock, so monitoring never holds up appenders. Each number is read
+ * atomically on its own, but they may not all be from the same moment.
+ *
+ * Memory used counts the segments, the elements themselves when the slots
+ * hold pointers, and the name arena or intern table. Index tables, frozen
+ * snapshots and anything removed but not yet freed aren't counted.
+ *
+ * @param[out] stats    The statistics.
+ */
+void get_data_array_stats(data_array_stats_t * stats) {
+    size_t i;
+
+    init_data_shards();
+
+    stats->count       = data_array_count();
+    stats->capacity    = data_array_capacity();
+    stats->num_growths = 0;
+    stats->num_removed = 0;
+    for (i = 0; i < DATA_ARRAY_NUM_SHARDS; i++) {
+        stats->num_growths += atomic_load_explicit(&g_data_shards[i].num_growths, memory_order_relaxed);
+        stats->num_removed += atomic_load_explicit(&g_data_shards[i].num_removed, memory_order_relaxed);
+    }
+
+    stats->bytes_used = stats->capacity * DATA_SLOT_BYTES;
+#if !DATA_ARRAY_INLINE
+    stats->bytes_used += stats->count * sizeof(named_data_t);
+#endif
+    stats->bytes_used += name_arena_bytes() + interned_names_bytes();
+}
+
+/**
+ * @brief Get the statistics of every shard's lock, added together.
+ *
+ * @param[out] stats    The statistics.
+ */
+void data_array_lock_stats(data_lock_stats_t * stats) {
+    size_t i;
+
+    init_data_shards();
+
+    memset(stats, 0, sizeof(data_lock_stats_t));
+    for (i = 0; i < DATA_ARRAY_NUM_SHARDS; i++) {
+        data_lock_add_stats(&g_data_shards[i].lock, stats);
+    }
+}
+
+/**
+ * @brief Make sure a shard has room for at least `num_elements`.
+ *
+ * @param shard         The shard.
+ * @param num_elements  Number of elements the shard should be able to hold.
+ * @return true         The shard has room for `num_elements`.
+ * @return false        Failed to allocate memory for the shard.
+ */
+static bool reserve_data_shard(data_shard_t * shard, size_t num_elements) {
+    bool status = false;
+
+    /* Lock the shard so we can safely add segments. */
+    data_lock_acquire(&shard->lock);
+
+    while (shard->size < num_elements) {
+        if (false == grow_data_shard(shard)) {
+            /* Failed to add a segment! */
+            goto unlock;
+        }
+    }
+
+    status = true;
+
+unlock:
+    /* Unlock the shard so other threads can access it once more. */
+    data_lock_release(&shard->lock);
+
+    return status;
+}
+
+/**
+ * @brief Make sure the global data array has room for at least `num_elements`.
+ *
+ * Bulk loaders can call this once up front so that the appends that follow
+ * rarely have to grow the array. The room is split evenly between the shards,
+ * so a shard that gets more than its share of the elements still grows.
+ *
+ * @param num_elements  Number of elements the array should be able to hold.
+ * @return true         The array has room for `num_elements`.
+ * @return false        Failed to allocate memory for the array.
+ */
+bool reserve_data_array(size_t num_elements) {
+    bool status = false;
+    size_t shard_elements = num_elements / DATA_ARRAY_NUM_SHARDS +
+                            (0 != num_elements % DATA_ARRAY_NUM_SHARDS);
+    size_t i;
+
+    init_data_shards();
+
+    for (i = 0; i < DATA_ARRAY_NUM_SHARDS; i++) {
+        if (false == reserve_data_shard(&g_data_shards[i], shard_elements)) {
+            goto done;
+        }
+    }
+
+    status = true;
+
+done:
+    return status;
+}
+
+/**
+ * @brief Free an element's name when the array is freed, if the element adopted it.
+ *
+ * Names in the arena or the intern table are freed all at once instead, but
+ * the arena stops counting adopted names one at a time, as they're freed.
+ *
+ * @param element   The element.
+ */
+static void free_adopted_data_element_name(named_data_t * element) {
+#if DATA_NAMES_INTERNED
+    (void)element;
+#else
+    if (element->name_len >= DATA_NAME_INLINE_SZ && NULL == element->name_buf.long_name_block) {
+        name_arena_disown(element->name_len + 1);
+        free((void *)element->name_buf.long_name);
+    }
+#endif
+}
+
+#if !DATA_ARRAY_INLINE
+/*
+ * Elements to free, split into chunks of DATA_TEARDOWN_CHUNK_SZ. Chunks are
+ * numbered across every shard in turn, and handed out in order to whichever
+ * teardown thread asks for one next.
+ */
+typedef struct {
+    _Atomic size_t next_chunk;
+    size_t first_chunk[DATA_ARRAY_NUM_SHARDS + 1];  /* First chunk of each shard, and the total */
+} teardown_work_t;
+
+/**
+ * @brief Free chunks of elements until there are none left.
+ *
+ * @param arg       The teardown_work_t.
+ * @return void*    NULL.
+ */
+static void * teardown_elements(void * arg) {
+    teardown_work_t * work = arg;
+    size_t chunk;
+
+    while ((chunk = atomic_fetch_add(&work->next_chunk, 1)) < work->first_chunk[DATA_ARRAY_NUM_SHARDS]) {
+        data_shard_t * shard;
+        size_t s = 0;
+        size_t i;
+        size_t end;
+
+        while (chunk >= work->first_chunk[s + 1]) {
+            s++;
+        }
+        shard = &g_data_shards[s];
+
+        i   = (chunk - work->first_chunk[s]) * DATA_TEARDOWN_CHUNK_SZ;
+        end = i + DATA_TEARDOWN_CHUNK_SZ;
+        if (end > shard->num_elements) {
+            end = shard->num_elements;
+        }
+
+        for (; i < end; i++) {
+            /*
+             * Free each data element.
+             * NULL checks not required because the num elements
+             * integer indicates that the element was allocated.
+             * Removed elements have been freed already.
+             */
+            if (false == data_shard_removed(shard, i)) {
+                free_adopted_data_element_name(data_shard_element(shard, i));
+                free(data_shard_element(shard, i));
+            }
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Clean up the global data array.
+ *
+ * Same as teardown_data_array() with the default options.
+ */
+void free_data_array(void) {
+    teardown_data_array(NULL);
+}
+
+/**
+ * @brief Clean up the global data array, with some control over how.
+ *
+ * Elements that were allocated one at a time (when the array isn't built with
+ * DATA_ARRAY_INLINE) can be freed by several threads at once, which helps
+ * when there are millions of them. Or they can be left for the process's exit
+ * to clean up, along with the names they adopted. Everything else is only a
+ * few allocations, so it's always freed by the caller.
+ *
+ * No other thread may be appending at the same time, since the names of the
+ * elements they're adding may live in the arena that this frees. For the same
+ * reason, elements still waiting in a thread's buffer (see data_buffer.c)
+ * must be flushed first. Nor may any thread be removing elements, and this
+ * mustn't be called from inside a read section.
+ *
+ * @param options   How to free the elements, or NULL for the defaults.
+ */
+void teardown_data_array(const data_teardown_options_t * options) {
+    size_t i = 0;
+    size_t s;
+#if !DATA_ARRAY_INLINE
+    teardown_work_t work = {0};
+    pthread_t threads[DATA_TEARDOWN_MAX_THREADS];
+    size_t num_threads = 1;
+    size_t num_started = 0;
+    bool skip_element_frees = false;
+
+    if (NULL != options) {
+        if (options->num_threads > num_threads) {
+            num_threads = options->num_threads;
+        }
+        if (num_threads > DATA_TEARDOWN_MAX_THREADS) {
+            num_threads = DATA_TEARDOWN_MAX_THREADS;
+        }
+        skip_element_frees = options->skip_element_frees;
+    }
+#else
+    /* Elements live in the segments, so only the names they adopted are freed one at a time. */
+    (void)options;
+#endif
+
+    /*
+     * Let removed elements be freed first. Their interned names are about to
+     * be freed along with the rest, and they must let go of them before that.
+     */
+    data_rcu_synchronize();
+
+    /* Lock every shard so we can safely free them all. */
+    lock_data_shards();
+
+#if !DATA_ARRAY_INLINE
+    if (false == skip_element_frees) {
+        for (s = 0; s < DATA_ARRAY_NUM_SHARDS; s++) {
+            size_t num_elements = g_data_shards[s].num_elements;
+
+            work.first_chunk[s + 1] = work.first_chunk[s] +
+                                      (num_elements + DATA_TEARDOWN_CHUNK_SZ - 1) / DATA_TEARDOWN_CHUNK_SZ;
+        }
+
+        /* Start helpers for the chunks beyond the first, and free the rest ourselves. */
+        while (num_started + 1 < num_threads && num_started + 1 < work.first_chunk[DATA_ARRAY_NUM_SHARDS]) {
+            if (0 != pthread_create(&threads[num_started], NULL, teardown_elements, &work)) {
+                /* We'll just have to do more of it ourselves. */
+                break;
+            }
+            num_started += 1;
+        }
+        (void)teardown_elements(&work);
+
+        for (i = 0; i < num_started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+#else
+    for (s = 0; 0 != name_arena_num_adopted() && s < DATA_ARRAY_NUM_SHARDS; s++) {
+        data_shard_t * shard = &g_data_shards[s];
+
+        for (i = 0; i < shard->num_elements; i++) {
+            if (false == data_shard_removed(shard, i)) {
+                free_adopted_data_element_name(data_shard_element(shard, i));
+            }
+        }
+    }
+#endif
+
+    for (s = 0; s < DATA_ARRAY_NUM_SHARDS; s++) {
+        data_shard_t * shard = &g_data_shards[s];
+
+        for (i = 0; i < shard->num_segments; i++) {
+            free(shard->segments[i]);
+            shard->segments[i] = NULL;
+        }
+        shard->num_segments = 0;
+        shard->size         = 0;
+        shard->num_removed  = 0; /* Before num_elements, see data_array_count() */
+        shard->num_elements = 0;
+        shard->num_reserved = DATA_SHARD_CLOSED; /* Reopened when we unlock */
+
+        data_index_clear(shard);
+    }
+
+    free_frozen_data_array();
+
+    /* Handles to the elements we just freed are stale now. */
+    start_data_array_generation();
+
+    /* Every long name lives in the arena, so this frees the rest of them at once. */
+    name_arena_reset();
+
+    /* ...or in the intern table, if they're interned. */
+    clear_interned_names();
+
+    /* Unlock every shard so other threads can access them once more. */
+    unlock_data_shards();
+
+    return;
+}
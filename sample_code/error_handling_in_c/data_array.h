@@ -0,0 +1,591 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * The global growable array of named data elements.
+ */
+
+#ifndef DATA_ARRAY_H
+#define DATA_ARRAY_H
+
+/* Standard libs */
+#include <stdatomic.h>  /* For _Atomic */
+#include <stdbool.h>    /* For bool */
+#include <stddef.h>     /* For size_t */
+#include <stdint.h>     /* For uint32_t */
+#include <limits.h>     /* For CHAR_BIT */
+#include <string.h>     /* For memcmp */
+
+/* 3rd-party Libs */
+#include <pthread.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>     /* For _BitScanForward64/_BitScanReverse64/_mm_prefetch */
+#endif
+
+/* Our headers */
+#include "data_lock.h"
+
+/*
+ * Names shorter than this (including the NULL terminator) are stored inside
+ * the element itself. Longer names are copied into the name arena, and the
+ * element remembers which block of the arena, so the name can be released.
+ */
+#define DATA_NAME_INLINE_SZ 24
+
+/*
+ * Build with DATA_NAMES_INTERNED=1 to have elements with the same name share
+ * one reference-counted copy of it from the intern table instead. Then two
+ * element names are equal if and only if they are the same pointer.
+ */
+#ifndef DATA_NAMES_INTERNED
+#define DATA_NAMES_INTERNED 0
+#endif
+
+/*
+ * The name length column records this for elements that have been removed.
+ * No name is allowed to be this long.
+ */
+#define DATA_NAME_REMOVED UINT32_MAX
+
+struct name_arena_block;
+
+typedef struct {
+    union {
+        char inline_name[DATA_NAME_INLINE_SZ];
+        struct {
+            const char *              long_name;
+            struct name_arena_block * long_name_block;  /* Arena block of the name, or NULL */
+        };
+    } name_buf;         /* Use data_element_name() to get at the name */
+    uint32_t name_len;  /* Length of the name, not counting the NULL terminator */
+    uint32_t name_hash; /* data_name_hash() of the name */
+    void * data;
+} named_data_t;
+
+/**
+ * @brief Get the name of an element.
+ *
+ * @param element       The element.
+ * @return const char*  NULL-terminated element name.
+ */
+static inline const char * data_element_name(const named_data_t * element) {
+    if (DATA_NAMES_INTERNED || element->name_len >= DATA_NAME_INLINE_SZ) {
+        return element->name_buf.long_name;
+    }
+    return element->name_buf.inline_name;
+}
+
+/**
+ * @brief Check if two elements have the same name.
+ *
+ * @param a         An element.
+ * @param b         Another element.
+ * @return true     The names are the same.
+ * @return false    The names differ.
+ */
+static inline bool data_element_names_equal(const named_data_t * a, const named_data_t * b) {
+#if DATA_NAMES_INTERNED
+    return a->name_buf.long_name == b->name_buf.long_name;
+#else
+    return a->name_len == b->name_len &&
+           0 == memcmp(data_element_name(a), data_element_name(b), a->name_len);
+#endif
+}
+
+/*
+ * Build with DATA_ARRAY_INLINE=1 to store the elements themselves in the array,
+ * rather than pointers to separately allocated elements. That saves a malloc
+ * per append and lets a scan walk the elements sequentially in memory.
+ */
+#ifndef DATA_ARRAY_INLINE
+#define DATA_ARRAY_INLINE 0
+#endif
+
+#if DATA_ARRAY_INLINE
+typedef named_data_t   data_slot_t;
+#else
+typedef named_data_t * data_slot_t;
+#endif
+
+/*
+ * We'll store the array in segments, so that growing the array never has to
+ * move the elements already in it. The first segment holds 128 elements and
+ * each segment after that is twice as big as the one before it.
+ */
+#define ARRAY_BLK_BITS 7
+#define ARRAY_BLK_SZ   ((size_t)1 << ARRAY_BLK_BITS)
+
+/* Number of elements in segment number `segment` */
+#define ARRAY_SEGMENT_SIZE(segment) (ARRAY_BLK_SZ << (segment))
+
+/*
+ * Build with DATA_ARRAY_LOCK_FREE=1 to let appends skip the shard lock while
+ * the shard has room, see try_store_data_element(). The lock is then only
+ * needed to add a segment.
+ */
+#ifndef DATA_ARRAY_LOCK_FREE
+#define DATA_ARRAY_LOCK_FREE 0
+#endif
+
+/*
+ * Each segment is a single allocation holding parallel columns: the slots,
+ * then the hash of each element's name, then the length of each element's
+ * name. A scan that filters by name can stay in the hash and length columns,
+ * and only has to touch the elements that match.
+ *
+ * Three more columns make up the slot map that handles go through, see
+ * data_handle_t: the entry of each slot's element, the slot of each entry,
+ * and the generation of each entry.
+ *
+ * Lock-free builds add a last column, with a flag for each slot that's set
+ * once the slot is filled in.
+ *
+ * Segments must be zeroed when they're allocated, so that the flags start out
+ * clear, and each slot starts out mapped to the entry with the same index.
+ */
+#define DATA_SLOT_READY_SZ (DATA_ARRAY_LOCK_FREE ? sizeof(atomic_uchar) : 0)
+
+/* Bytes each slot takes up in a segment, counting every column */
+#define DATA_SLOT_BYTES (sizeof(data_slot_t) + 5 * sizeof(uint32_t) + DATA_SLOT_READY_SZ)
+
+#define ARRAY_SEGMENT_BYTES(segment) (ARRAY_SEGMENT_SIZE(segment) * DATA_SLOT_BYTES)
+
+/*
+ * Maximum number of segments. This leaves enough headroom that the size of the
+ * whole array in bytes always fits in a size_t.
+ */
+#define ARRAY_MAX_SEGMENTS (sizeof(size_t) * CHAR_BIT - ARRAY_BLK_BITS - 8)
+
+/**
+ * @brief Find the floor of log2(value) with a single bit-scan.
+ *
+ * @param value     Value to scan, must not be 0.
+ * @return size_t   Index of the highest set bit.
+ */
+static inline size_t data_array_log2(size_t value) {
+#if defined(_MSC_VER)
+    unsigned long top_bit;
+    _BitScanReverse64(&top_bit, value);
+    return top_bit;
+#else
+    return sizeof(unsigned long long) * CHAR_BIT - 1 - __builtin_clzll(value);
+#endif
+}
+
+/**
+ * @brief Find the lowest set bit with a single bit-scan.
+ *
+ * @param value     Value to scan.
+ * @return size_t   One more than the index of the lowest set bit, or 0 if
+ *                  no bit is set, the same as ffs().
+ */
+static inline size_t data_array_ffs(uint64_t value) {
+#if defined(_MSC_VER)
+    unsigned long low_bit;
+    return _BitScanForward64(&low_bit, value) ? low_bit + 1 : 0;
+#else
+    return __builtin_ffsll((long long)value);
+#endif
+}
+
+/**
+ * @brief Start fetching memory into the cache, without waiting for it.
+ *
+ * @param ptr   Address to fetch. Needn't be valid, since nothing is read.
+ */
+static inline void data_prefetch(const void * ptr) {
+#if defined(_MSC_VER)
+    _mm_prefetch((const char *)ptr, _MM_HINT_T0);
+#else
+    __builtin_prefetch(ptr);
+#endif
+}
+
+/**
+ * @brief Find which segment an element in a shard is in.
+ *
+ * Segment `n` starts at element `ARRAY_BLK_SZ * (2^n - 1)`, so offsetting the
+ * index by ARRAY_BLK_SZ puts the segment number in the highest set bit and the
+ * offset within the segment in the bits below it.
+ *
+ * @param index         Element index, must be less than the shard's size.
+ * @param[out] offset   Offset of the element within its segment.
+ * @return size_t       Segment number.
+ */
+static inline size_t data_array_locate(size_t index, size_t * offset) {
+    size_t biased  = index + ARRAY_BLK_SZ;
+    size_t top_bit = data_array_log2(biased);
+
+    *offset = biased - ((size_t)1 << top_bit);
+    return top_bit - ARRAY_BLK_BITS;
+}
+
+/*
+ * The array is split into shards, each with its own lock, segments and name
+ * index, so that threads adding elements with different names rarely wait on
+ * each other. An element's shard is picked by the hash of its name, so every
+ * element with the same name is in the same shard, and a lookup or scan by
+ * name only has to search that one shard.
+ *
+ * Segments never move or shrink once they're added, until the whole array is
+ * freed, and elements only move when the array is compacted, which shuts
+ * readers out while they do. So the first num_elements elements of a shard
+ * can be read without its lock from inside a read section (see data_rcu.h),
+ * and lookups and scans don't take it.
+ *
+ * Build with DATA_ARRAY_NUM_SHARDS=N to use N shards. With one shard, the
+ * array keeps every element in the order they were added.
+ */
+#ifndef DATA_ARRAY_NUM_SHARDS
+#define DATA_ARRAY_NUM_SHARDS 1
+#endif
+
+/* Shards are cache line aligned, so locking one doesn't slow down its neighbours */
+#define DATA_SHARD_ALIGN 64
+
+typedef struct {
+    _Alignas(DATA_SHARD_ALIGN) data_lock_t lock;   /* See data_lock.h */
+    data_slot_t * segments[ARRAY_MAX_SEGMENTS]; /* Directory of shard segments */
+    size_t num_segments;            /* Number of segments in the directory */
+    _Atomic size_t size;            /* Size of shard (in elements) */
+    _Atomic size_t num_reserved;    /* Number of slots handed out to appenders, see data_array.c */
+    _Atomic size_t num_elements;    /* Number of elements in shard, every one of them complete */
+    _Atomic size_t num_removed;     /* Number of those elements that have since been removed */
+    _Atomic uint64_t num_growths;   /* Number of segments ever added, even if since freed */
+
+    /* Hash index over the shard's elements, see data_index.c */
+    _Atomic(struct data_index_table *) index;
+} data_shard_t;
+
+extern data_shard_t g_data_shards[DATA_ARRAY_NUM_SHARDS];
+
+/**
+ * @brief Get the name hash column of a segment.
+ *
+ * @param shard         The shard.
+ * @param segment       Segment number, must be less than shard->num_segments.
+ * @return uint32_t*    Name hash of each element in the segment.
+ */
+static inline uint32_t * data_segment_hashes(const data_shard_t * shard, size_t segment) {
+    return (uint32_t *)(shard->segments[segment] + ARRAY_SEGMENT_SIZE(segment));
+}
+
+/**
+ * @brief Get the name length column of a segment.
+ *
+ * Removing an element sets its length to DATA_NAME_REMOVED while others may
+ * be reading it, so the column is atomic.
+ *
+ * @param shard         The shard.
+ * @param segment       Segment number, must be less than shard->num_segments.
+ * @return _Atomic uint32_t*    Name length of each element in the segment.
+ */
+static inline _Atomic uint32_t * data_segment_name_lens(const data_shard_t * shard, size_t segment) {
+    return (_Atomic uint32_t *)(data_segment_hashes(shard, segment) + ARRAY_SEGMENT_SIZE(segment));
+}
+
+/**
+ * @brief Get the slot map entry column of a segment.
+ *
+ * Holds one more than the entry of the element in each slot, or 0 if it's
+ * still the entry with the same index as the slot. Only compaction changes it.
+ *
+ * @param shard         The shard.
+ * @param segment       Segment number, must be less than shard->num_segments.
+ * @return uint32_t*    Slot map entry of each slot in the segment.
+ */
+static inline uint32_t * data_segment_entries(const data_shard_t * shard, size_t segment) {
+    return data_segment_hashes(shard, segment) + 2 * ARRAY_SEGMENT_SIZE(segment);
+}
+
+/**
+ * @brief Get the entry slot column of a segment.
+ *
+ * Indexed by slot map entry rather than by slot. Holds one more than the slot
+ * each entry's element is in, or 0 if it's still the slot with the same index
+ * as the entry. Only compaction changes it.
+ *
+ * @param shard         The shard.
+ * @param segment       Segment number, must be less than shard->num_segments.
+ * @return uint32_t*    Slot of each entry in the segment.
+ */
+static inline uint32_t * data_segment_entry_slots(const data_shard_t * shard, size_t segment) {
+    return data_segment_hashes(shard, segment) + 3 * ARRAY_SEGMENT_SIZE(segment);
+}
+
+/**
+ * @brief Get the entry generation column of a segment.
+ *
+ * Indexed by slot map entry rather than by slot. Holds the generation of each
+ * entry, or 0 if it's still the one the array started with. Removing an
+ * entry's element moves it on to the next one while others may be reading it,
+ * so the column is atomic.
+ *
+ * @param shard         The shard.
+ * @param segment       Segment number, must be less than shard->num_segments.
+ * @return _Atomic uint32_t*    Generation of each entry in the segment.
+ */
+static inline _Atomic uint32_t * data_segment_entry_generations(const data_shard_t * shard, size_t segment) {
+    return (_Atomic uint32_t *)(data_segment_hashes(shard, segment) + 4 * ARRAY_SEGMENT_SIZE(segment));
+}
+
+/**
+ * @brief Get the ready flag column of a segment, in lock-free builds.
+ *
+ * @param shard         The shard.
+ * @param segment       Segment number, must be less than shard->num_segments.
+ * @return atomic_uchar*    Whether each slot in the segment has been filled in.
+ */
+static inline atomic_uchar * data_segment_ready(const data_shard_t * shard, size_t segment) {
+    return (atomic_uchar *)(data_segment_hashes(shard, segment) + 5 * ARRAY_SEGMENT_SIZE(segment));
+}
+
+/**
+ * @brief Get the slot for an element in a shard.
+ *
+ * @param shard             The shard.
+ * @param index             Element index, must be less than shard->size.
+ * @return data_slot_t*     Pointer to the slot for that element.
+ */
+static inline data_slot_t * data_shard_slot(const data_shard_t * shard, size_t index) {
+    size_t offset;
+    size_t segment = data_array_locate(index, &offset);
+
+    return &shard->segments[segment][offset];
+}
+
+/**
+ * @brief Get an element in a shard.
+ *
+ * To visit every element in the array, visit every element of every shard in
+ * g_data_shards.
+ *
+ * @param shard             The shard.
+ * @param index             Element index, must be less than shard->num_elements.
+ * @return named_data_t*    The element.
+ */
+static inline named_data_t * data_shard_element(const data_shard_t * shard, size_t index) {
+#if DATA_ARRAY_INLINE
+    return data_shard_slot(shard, index);
+#else
+    return *data_shard_slot(shard, index);
+#endif
+}
+
+/**
+ * @brief Check if an element in a shard has been removed.
+ *
+ * Removed elements are freed once no reader can be using them (see
+ * data_rcu.h), so only look at an element that isn't removed from inside a
+ * read section, if other threads may be removing elements.
+ *
+ * @param shard     The shard.
+ * @param index     Element index, must be less than shard->num_elements.
+ * @return true     The element has been removed.
+ * @return false    The element is still in the array.
+ */
+static inline bool data_shard_removed(const data_shard_t * shard, size_t index) {
+    size_t offset;
+    size_t segment = data_array_locate(index, &offset);
+
+    return DATA_NAME_REMOVED ==
+           atomic_load_explicit(&data_segment_name_lens(shard, segment)[offset], memory_order_relaxed);
+}
+
+/*
+ * A handle finds an element again in constant time, see get_data_element().
+ * It goes through a slot map: each shard has an entry for each of its slots,
+ * which says which slot that entry's element is in now. Compaction moves the
+ * entries along with the elements, so handles stay valid across it.
+ *
+ * A handle packs the element's shard and entry together with the entry's
+ * generation when the element was added. Removing the element moves its entry
+ * on to the next generation, and freeing the array starts every entry on a
+ * generation no handle has, so only handles to elements that are gone are
+ * known to be stale. Generations wrap around after 2^24 removals from the same
+ * entry.
+ *
+ * 0 is never a valid handle.
+ */
+typedef uint64_t data_handle_t;
+
+#define DATA_HANDLE_INVALID         ((data_handle_t)0)
+#define DATA_HANDLE_ENTRY_BITS      32
+#define DATA_HANDLE_SHARD_BITS      8
+#define DATA_HANDLE_GENERATION_BITS 24
+
+_Static_assert(DATA_ARRAY_NUM_SHARDS <= (1 << DATA_HANDLE_SHARD_BITS), "Too many shards for a data handle");
+
+/**
+ * @brief Get the slot map entry of the element a handle is for.
+ *
+ * @param handle    The handle.
+ * @return size_t   Entry index within the element's shard.
+ */
+static inline size_t data_handle_entry(data_handle_t handle) {
+    return (size_t)(handle & (((data_handle_t)1 << DATA_HANDLE_ENTRY_BITS) - 1));
+}
+
+/**
+ * @brief Get the number of the shard the element a handle is for is in.
+ *
+ * @param handle    The handle.
+ * @return size_t   Index of the shard in g_data_shards.
+ */
+static inline size_t data_handle_shard(data_handle_t handle) {
+    return (size_t)((handle >> DATA_HANDLE_ENTRY_BITS) & ((1 << DATA_HANDLE_SHARD_BITS) - 1));
+}
+
+/**
+ * @brief Get the generation of its entry that a handle's element was added in.
+ *
+ * @param handle        The handle.
+ * @return uint32_t     The generation, never 0.
+ */
+static inline uint32_t data_handle_generation(data_handle_t handle) {
+    return (uint32_t)(handle >> (DATA_HANDLE_ENTRY_BITS + DATA_HANDLE_SHARD_BITS));
+}
+
+data_shard_t * data_array_shard(uint32_t name_hash);
+void lock_data_shards(void);
+void unlock_data_shards(void);
+
+size_t data_shard_room(const data_shard_t * shard);
+bool data_shard_full(const data_shard_t * shard);
+size_t data_shard_next_segment(const data_shard_t * shard);
+
+/*
+ * The caller must hold the shard's lock for this.
+ */
+bool install_data_segment(data_shard_t * shard, size_t segment, data_slot_t * new_segment);
+
+bool set_data_element_name_n(named_data_t * element, const char * name, size_t name_len);
+bool set_data_element_name(named_data_t * element, const char * name);
+bool set_data_element_name_owned(named_data_t * element, char * name);
+void free_data_element_name(named_data_t * element);
+
+bool alloc_data_node(named_data_t ** node);
+
+/*
+ * The caller must hold the shard's lock for this.
+ */
+bool store_data_element(data_shard_t * shard, const named_data_t * element, named_data_t * node,
+                        data_handle_t * handle);
+
+/*
+ * ...but not for this.
+ */
+bool try_store_data_element(data_shard_t * shard, const named_data_t * element, named_data_t * node,
+                            data_handle_t * handle);
+
+/*
+ * This locks the shards it needs by itself.
+ */
+size_t store_data_elements(named_data_t * elements, size_t num_elements, bool * stored);
+
+size_t append_data_elements(const char * const * names, void * const * datas, size_t num_elements, bool * added);
+bool append_data_element_owned(char * name, void * data);
+bool append_data_element_handle(const char * name, size_t name_len, void * data, data_handle_t * handle);
+
+/**
+ * @brief Add a new named data element to the global array, from a slice of a name.
+ *
+ * @param name      Element name, which needn't be NULL-terminated
+ * @param name_len  Length of the name
+ * @param data      Pointer to the element data
+ * @return true     Element successfully added.
+ * @return false    Failed to add element.
+ */
+static inline bool append_data_element_n(const char * name, size_t name_len, void * data) {
+    return append_data_element_handle(name, name_len, data, NULL);
+}
+
+named_data_t * get_data_element(data_handle_t handle);
+
+/**
+ * @brief Callback for each element visited by a scan.
+ *
+ * @param element   The element.
+ * @param ctx       Context passed through from the caller of the scan.
+ * @return true     Keep scanning.
+ * @return false    Stop the scan.
+ */
+typedef bool (*data_element_visitor_t)(named_data_t * element, void * ctx);
+
+size_t find_data_element(
+    const data_shard_t * shard,
+    const char * name,
+    size_t name_len,
+    uint32_t hash,
+    size_t start,
+    size_t end);
+size_t scan_data_elements_by_name(const char * name, data_element_visitor_t visitor, void * ctx);
+
+/* for_each_data_element() hands out the elements in chunks of up to this many */
+#ifndef DATA_SCAN_CHUNK_SZ
+#define DATA_SCAN_CHUNK_SZ 64
+#endif
+
+/**
+ * @brief Callback for each chunk of elements visited by for_each_data_element().
+ *
+ * @param elements      The elements in the chunk.
+ * @param num_elements  Number of elements in the chunk, at most DATA_SCAN_CHUNK_SZ.
+ * @param ctx           Context passed through from the caller of the scan.
+ * @return true         Keep scanning.
+ * @return false        Stop the scan.
+ */
+typedef bool (*data_chunk_visitor_t)(named_data_t * const * elements, size_t num_elements, void * ctx);
+
+size_t for_each_data_element(data_chunk_visitor_t visitor, void * ctx);
+bool remove_data_element(const char * name);
+bool remove_data_element_by_handle(data_handle_t handle);
+
+typedef enum {
+    DATA_COMPACT_KEEP_ORDER,    /* Elements stay in the order they were added */
+    DATA_COMPACT_ANY_ORDER,     /* Each shard's last elements fill its holes, so fewer move */
+} data_compact_order_t;
+
+/*
+ * A maintenance pass for quiet moments, not something to run alongside heavy
+ * traffic. It compacts one shard at a time, but shuts out every reader while
+ * a shard's elements move, so it must not be called from inside a read
+ * section. It checks, and reclaims nothing if it is.
+ */
+size_t compact_data_array(data_compact_order_t order);
+
+size_t data_array_count(void);
+size_t data_array_used_slots(void);
+size_t data_array_capacity(void);
+void data_array_lock_stats(data_lock_stats_t * stats);
+
+typedef struct {
+    size_t   count;         /* Elements in the array, see data_array_count() */
+    size_t   capacity;      /* Elements it can hold without growing, see data_array_capacity() */
+    size_t   bytes_used;    /* Memory held by the segments, the elements and their names */
+    uint64_t num_growths;   /* Segments added since the program started */
+    size_t   num_removed;   /* Removed elements whose slots compact_data_array() can reclaim */
+} data_array_stats_t;
+
+void get_data_array_stats(data_array_stats_t * stats);
+bool reserve_data_array(size_t num_elements);
+void free_data_array(void);
+
+/* Teardown hands out the elements to free in chunks of this many */
+#ifndef DATA_TEARDOWN_CHUNK_SZ
+#define DATA_TEARDOWN_CHUNK_SZ 65536
+#endif
+
+/* Most threads teardown_data_array() will free elements on */
+#ifndef DATA_TEARDOWN_MAX_THREADS
+#define DATA_TEARDOWN_MAX_THREADS 64
+#endif
+
+typedef struct {
+    size_t num_threads;         /* Threads to free elements on, counting the caller. 0 means 1. */
+    bool   skip_element_frees;  /* Don't free elements one at a time, e.g. since the process is exiting */
+} data_teardown_options_t;
+
+void teardown_data_array(const data_teardown_options_t * options);
+
+#endif /* DATA_ARRAY_H */
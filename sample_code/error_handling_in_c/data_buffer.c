@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Per-thread buffers for adding elements to the global data array in batches.
+ *
+ * buffer_data_element() copies the element into the calling thread's buffer,
+ * which takes no lock at all. Once the buffer holds DATA_BUFFER_SIZE elements,
+ * or when the thread calls flush_data_elements(), the whole batch is stored,
+ * locking each shard it touches once rather than once per element.
+ *
+ * Buffered elements can't be looked up until they're flushed. Elements that
+ * go in the same shard are stored in the order they were buffered, so the
+ * first element buffered with a name is still the one lookups find. Whatever
+ * a thread still has buffered when it exits is flushed then.
+ */
+
+/* Standard headers */
+#include <stdbool.h>    /* For bool */
+
+/* 3rd-party headers */
+#include <pthread.h>
+
+/* Our headers */
+#include "data_array.h"
+#include "data_buffer.h"
+#include "data_freeze.h"
+
+typedef struct {
+    size_t num_elements;
+    named_data_t elements[DATA_BUFFER_SIZE];
+} data_buffer_t;
+
+static pthread_once_t g_buffer_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_buffer_key;
+
+static _Thread_local data_buffer_t t_data_buffer;
+static _Thread_local bool t_data_buffer_registered = false;
+
+/**
+ * @brief Flush a thread's buffer when the thread exits.
+ *
+ * Elements that still can't be stored are thrown away.
+ *
+ * @param buffer    The thread's buffer.
+ */
+static void release_buffer(void * buffer) {
+    data_buffer_t * data_buffer = buffer;
+    size_t i;
+
+    (void)flush_data_elements();
+
+    for (i = 0; i < data_buffer->num_elements; i++) {
+        free_data_element_name(&data_buffer->elements[i]);
+    }
+    data_buffer->num_elements = 0;
+}
+
+/**
+ * @brief Make the key used to find out when threads exit.
+ */
+static void create_buffer_key(void) {
+    pthread_key_create(&g_buffer_key, release_buffer);
+}
+
+/**
+ * @brief Store every element in this thread's buffer.
+ *
+ * If a shard can't take one of its elements, that element and the ones after
+ * it for the same shard stay in the buffer, in order, for the next flush. See
+ * store_data_elements().
+ *
+ * @return true     Every buffered element was stored.
+ * @return false    Out of memory, or the array is frozen. Some elements are still buffered.
+ */
+bool flush_data_elements(void) {
+    data_buffer_t * buffer = &t_data_buffer;
+
+    buffer->num_elements = store_data_elements(buffer->elements, buffer->num_elements, NULL);
+
+    return 0 == buffer->num_elements;
+}
+
+/**
+ * @brief Add a new named data element to this thread's buffer.
+ *
+ * The element is added to the global array by the next flush. That happens
+ * by itself once the buffer is full, see flush_data_elements().
+ *
+ * @param name      Element name
+ * @param data      Pointer to the element data
+ * @return true     Element successfully buffered.
+ * @return false    Failed to buffer element.
+ */
+bool buffer_data_element(const char * name, void * data) {
+    bool status = false;
+    data_buffer_t * buffer = &t_data_buffer;
+    named_data_t new_element = {0};
+
+    if (NULL == name || NULL == data) {
+        /* Bad args! */
+        goto done;
+    }
+
+    if (data_array_frozen()) {
+        /* No appends until the array is unfrozen! */
+        goto done;
+    }
+
+    if (false == t_data_buffer_registered) {
+        /* Make sure whatever is left in the buffer is flushed when the thread exits. */
+        pthread_once(&g_buffer_key_once, create_buffer_key);
+        if (0 != pthread_setspecific(g_buffer_key, buffer)) {
+            /* Out of memory! */
+            goto done;
+        }
+        t_data_buffer_registered = true;
+    }
+
+    if (DATA_BUFFER_SIZE == buffer->num_elements) {
+        /* The last flush didn't make room, try again. */
+        (void)flush_data_elements();
+        if (DATA_BUFFER_SIZE == buffer->num_elements) {
+            /* Buffer is still full! */
+            goto done;
+        }
+    }
+
+    /* We don't own the name, so let's copy it. */
+    if (false == set_data_element_name(&new_element, name)) {
+        /* Out of memory! */
+        goto done;
+    }
+
+    /* We're given ownership of the data, so we'll assign the pointer. */
+    new_element.data = data;
+
+    buffer->elements[buffer->num_elements++] = new_element;
+
+    if (DATA_BUFFER_SIZE == buffer->num_elements) {
+        /* Anything that can't be stored yet stays buffered for the next flush. */
+        (void)flush_data_elements();
+    }
+
+    /* Success! */
+    status = true;
+
+done:
+    return status;
+}
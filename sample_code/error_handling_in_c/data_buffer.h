@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Per-thread buffers for adding elements to the global data array in batches.
+ */
+
+#ifndef DATA_BUFFER_H
+#define DATA_BUFFER_H
+
+#include <stdbool.h>    /* For bool */
+
+/* Each thread's buffer is flushed once it holds this many elements */
+#ifndef DATA_BUFFER_SIZE
+#define DATA_BUFFER_SIZE 64
+#endif
+
+bool buffer_data_element(const char * name, void * data);
+bool flush_data_elements(void);
+
+#endif /* DATA_BUFFER_H */
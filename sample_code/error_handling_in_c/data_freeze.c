@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Read-only, search-optimized snapshot of the global data array.
+ *
+ * Freezing sorts the elements by name into an Eytzinger layout: the sorted
+ * elements are laid out as an implicit binary search tree in breadth-first
+ * order, with the children of entry k at 2k and 2k+1. The first levels of the
+ * tree share a few cache lines, and a search can prefetch the entries it will
+ * visit a couple of levels down. The names are packed into one contiguous
+ * buffer so the comparisons don't chase pointers all over the heap.
+ *
+ * While the array is frozen it can't change, so lookups need no lock at all.
+ * Appends and removals fail until the array is unfrozen. Unfreezing retires the snapshot
+ * until no lookup can still be searching it (see data_rcu.c).
+ */
+
+/* Standard headers */
+#include <stdatomic.h>  /* For atomic_load_explicit/atomic_store_explicit */
+#include <stdbool.h>    /* For bool */
+#include <stdlib.h>     /* For malloc/free/qsort */
+#include <string.h>     /* For memcmp/memcpy */
+
+/* 3rd-party headers */
+#include <pthread.h>
+
+/* Our headers */
+#include "data_array.h"
+#include "data_freeze.h"
+#include "data_rcu.h"
+
+typedef struct {
+    const char *   name;       /* Points into the packed names buffer */
+    size_t         name_len;
+    named_data_t * element;
+} frozen_entry_t;
+
+typedef struct frozen_data_array {
+    size_t num_entries;
+    frozen_entry_t * entries;           /* entries[1..num_entries], in Eytzinger order */
+    char * names;                       /* Every name, packed end to end */
+} frozen_data_array_t;
+
+/* Current snapshot, or NULL if the array isn't frozen */
+static _Atomic(frozen_data_array_t *) g_frozen_data_array = NULL;
+
+/*
+ * An element waiting to be sorted, with its position in its shard. Elements
+ * with the same name are always in the same shard, so that's enough to tell
+ * which of them was added first.
+ */
+typedef struct {
+    frozen_entry_t entry;
+    size_t index;
+} sort_entry_t;
+
+/**
+ * @brief Compare two names, in the order the snapshot is sorted in.
+ *
+ * @return int  <0, 0, or >0 if a sorts before, with, or after b.
+ */
+static int compare_names(const char * a, size_t a_len, const char * b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (0 != cmp) {
+        return cmp;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/**
+ * @brief qsort() comparator. Sort by name, then by position in the shard.
+ */
+static int compare_sort_entries(const void * a, const void * b) {
+    const sort_entry_t * entry_a = a;
+    const sort_entry_t * entry_b = b;
+    int cmp;
+
+    cmp = compare_names(entry_a->entry.name, entry_a->entry.name_len,
+                        entry_b->entry.name, entry_b->entry.name_len);
+    if (0 != cmp) {
+        return cmp;
+    }
+    return (entry_a->index > entry_b->index) - (entry_a->index < entry_b->index);
+}
+
+/**
+ * @brief Lay sorted entries out in Eytzinger order.
+ *
+ * An in-order walk of the implicit tree visits the sorted entries in order.
+ *
+ * @param sorted        Entries sorted by name.
+ * @param next_sorted   Index of the next sorted entry to place.
+ * @param entries       Eytzinger-ordered entries (1-based).
+ * @param k             Tree node to fill in.
+ * @param num_entries   Number of entries.
+ * @return size_t       Index of the next sorted entry to place.
+ */
+static size_t eytzinger_fill(
+    const sort_entry_t * sorted,
+    size_t next_sorted,
+    frozen_entry_t * entries,
+    size_t k,
+    size_t num_entries)
+{
+    if (k <= num_entries) {
+        next_sorted = eytzinger_fill(sorted, next_sorted, entries, 2 * k, num_entries);
+        entries[k]  = sorted[next_sorted++].entry;
+        next_sorted = eytzinger_fill(sorted, next_sorted, entries, 2 * k + 1, num_entries);
+    }
+    return next_sorted;
+}
+
+/**
+ * @brief Free a snapshot.
+ */
+static void free_frozen(void * ptr) {
+    frozen_data_array_t * frozen = ptr;
+
+    if (NULL != frozen) {
+        free(frozen->entries);
+        free(frozen->names);
+        free(frozen);
+    }
+}
+
+/**
+ * @brief Freeze the global data array.
+ *
+ * Builds a sorted, read-only snapshot of the elements that lookups can search
+ * without taking a lock. Until unfreeze_data_array() is called, appends and removals fail.
+ * Freezing an array that is already frozen does nothing.
+ *
+ * @return true     Array frozen.
+ * @return false    Out of memory.
+ */
+bool freeze_data_array(void) {
+    bool status = false;
+    frozen_data_array_t * frozen = NULL;
+    sort_entry_t * sorted = NULL;
+    size_t names_size = 0;
+    size_t num_elements = 0;
+    size_t num_sorted;
+    size_t shard;
+    size_t i;
+    char * next_name;
+
+    /* Lock every shard so the array can't change while we snapshot it. */
+    lock_data_shards();
+
+    if (NULL != atomic_load_explicit(&g_frozen_data_array, memory_order_relaxed)) {
+        /* Already frozen */
+        status = true;
+        goto unlock;
+    }
+
+    frozen = calloc(1, sizeof(frozen_data_array_t));
+    if (NULL == frozen) {
+        /* Out of memory! */
+        goto unlock;
+    }
+
+    for (shard = 0; shard < DATA_ARRAY_NUM_SHARDS; shard++) {
+        num_elements += g_data_shards[shard].num_elements - g_data_shards[shard].num_removed;
+    }
+
+    sorted = malloc((num_elements + 1) * sizeof(sort_entry_t));
+    if (NULL == sorted) {
+        /* Out of memory! */
+        goto unlock;
+    }
+
+    num_sorted = 0;
+    for (shard = 0; shard < DATA_ARRAY_NUM_SHARDS; shard++) {
+        for (i = 0; i < g_data_shards[shard].num_elements; i++) {
+            named_data_t * element = data_shard_element(&g_data_shards[shard], i);
+
+            if (data_shard_removed(&g_data_shards[shard], i)) {
+                continue;
+            }
+
+            sorted[num_sorted].entry.name     = data_element_name(element);
+            sorted[num_sorted].entry.name_len = element->name_len;
+            sorted[num_sorted].entry.element  = element;
+            sorted[num_sorted].index          = i;
+            names_size += element->name_len + 1;
+            num_sorted += 1;
+        }
+    }
+    qsort(sorted, num_elements, sizeof(sort_entry_t), compare_sort_entries);
+
+    /*
+     * Keep only the first element added with each name, the same one that
+     * lookup_data_element() finds when the array isn't frozen.
+     */
+    num_sorted = 0;
+    for (i = 0; i < num_elements; i++) {
+        if (0 == num_sorted ||
+            0 != compare_names(sorted[num_sorted - 1].entry.name, sorted[num_sorted - 1].entry.name_len,
+                               sorted[i].entry.name, sorted[i].entry.name_len)) {
+            sorted[num_sorted++] = sorted[i];
+        }
+    }
+
+    /* Pack the names end to end. */
+    frozen->names = malloc(names_size + 1);
+    if (NULL == frozen->names) {
+        /* Out of memory! */
+        goto unlock;
+    }
+    next_name = frozen->names;
+    for (i = 0; i < num_sorted; i++) {
+        memcpy(next_name, sorted[i].entry.name, sorted[i].entry.name_len);
+        next_name[sorted[i].entry.name_len] = '\0';
+        sorted[i].entry.name = next_name;
+        next_name += sorted[i].entry.name_len + 1;
+    }
+
+    frozen->entries = malloc((num_sorted + 1) * sizeof(frozen_entry_t));
+    if (NULL == frozen->entries) {
+        /* Out of memory! */
+        goto unlock;
+    }
+    frozen->num_entries = num_sorted;
+    eytzinger_fill(sorted, 0, frozen->entries, 1, num_sorted);
+
+    /* Publish the snapshot. Lookups that see it also see everything in it. */
+    atomic_store_explicit(&g_frozen_data_array, frozen, memory_order_release);
+    frozen = NULL;
+
+    status = true;
+
+unlock:
+    /* Unlock every shard so other threads can access them once more. */
+    unlock_data_shards();
+
+    free(sorted);
+    free_frozen(frozen);
+
+    return status;
+}
+
+/**
+ * @brief Unfreeze the global data array, so that elements can be added again.
+ *
+ * The snapshot is retired rather than freed, in case a lookup is still
+ * searching it.
+ */
+void unfreeze_data_array(void) {
+    frozen_data_array_t * frozen;
+
+    lock_data_shards();
+
+    frozen = atomic_exchange_explicit(&g_frozen_data_array, NULL, memory_order_relaxed);
+
+    unlock_data_shards();
+
+    data_rcu_retire(frozen, free_frozen);
+}
+
+/**
+ * @brief Check if the global data array is frozen.
+ *
+ * @return true     Frozen.
+ * @return false    Not frozen.
+ */
+bool data_array_frozen(void) {
+    return NULL != atomic_load_explicit(&g_frozen_data_array, memory_order_acquire);
+}
+
+/**
+ * @brief Look an element up in the frozen snapshot, without taking a lock.
+ *
+ * @param name          Element name.
+ * @param name_len      Length of the name.
+ * @param[out] element  First element added with that name, or NULL if there isn't one.
+ * @return true         The array is frozen, and `element` is the answer.
+ * @return false        The array isn't frozen, so look elsewhere.
+ */
+bool lookup_frozen_data_element(const char * name, size_t name_len, named_data_t ** element) {
+    const frozen_data_array_t * frozen;
+    const frozen_entry_t * entries;
+    size_t num_entries;
+    size_t k = 1;
+
+    frozen = atomic_load_explicit(&g_frozen_data_array, memory_order_acquire);
+    if (NULL == frozen) {
+        return false;
+    }
+    entries     = frozen->entries;
+    num_entries = frozen->num_entries;
+
+    /*
+     * Walk down the tree to the first entry that isn't less than the name.
+     * The four grandchildren of entry k are adjacent, so fetch them early.
+     */
+    while (k <= num_entries) {
+        data_prefetch(&entries[4 * k]);
+        k = 2 * k + (compare_names(entries[k].name, entries[k].name_len, name, name_len) < 0);
+    }
+
+    /* Undo the right turns we took after the last left turn. */
+    k >>= data_array_ffs(~(uint64_t)k);
+
+    *element = NULL;
+    if (0 != k &&
+        0 == compare_names(entries[k].name, entries[k].name_len, name, name_len)) {
+        *element = entries[k].element;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Retire the snapshot, when the data array is freed.
+ *
+ * The caller must hold every shard's lock.
+ */
+void free_frozen_data_array(void) {
+    data_rcu_retire(atomic_exchange_explicit(&g_frozen_data_array, NULL, memory_order_relaxed),
+                    free_frozen);
+}
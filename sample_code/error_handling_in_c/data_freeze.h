@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Read-only, search-optimized snapshot of the global data array.
+ */
+
+#ifndef DATA_FREEZE_H
+#define DATA_FREEZE_H
+
+#include <stdbool.h>    /* For bool */
+#include <stddef.h>     /* For size_t */
+
+#include "data_array.h"
+
+bool freeze_data_array(void);
+void unfreeze_data_array(void);
+bool data_array_frozen(void);
+
+bool lookup_frozen_data_element(const char * name, size_t name_len, named_data_t ** element);
+
+/*
+ * The caller must hold every shard's lock for this.
+ */
+void free_frozen_data_array(void);
+
+#endif /* DATA_FREEZE_H */
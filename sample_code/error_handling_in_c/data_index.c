@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Hash index over each shard of the global data array, for looking elements
+ * up by name.
+ *
+ * The index is an open-addressing hash table with linear probing. Each entry
+ * keeps the hash of the name beside the element pointer, so most probes that
+ * don't match are rejected without touching the element.
+ *
+ * Names need not be unique. The index keeps the first element added with each
+ * name, and that is the one lookup_data_element() returns.
+ *
+ * Appending doesn't touch the index, so that appenders don't need the shard's
+ * lock. Instead, lookups add the elements appended since the index was last
+ * updated, in the order they were added.
+ *
+ * Lookups search the index without taking the shard's lock. Each entry is
+ * published with a release store of its element pointer. When the table fills
+ * up, a bigger copy is published in its place, and the old one is retired
+ * until no lookup can still be searching it (see data_rcu.c).
+ *
+ * Removing an element points its entry at the next element with the same
+ * name. If there isn't one, the entry becomes a tombstone, which lookups probe
+ * past. Tombstones are dropped the next time the table is resized. Each entry
+ * also records where its element is in the shard, so that removing an element
+ * by name doesn't have to search the shard for it.
+ */
+
+/* Standard headers */
+#include <stdatomic.h>  /* For atomic_load_explicit/atomic_store_explicit */
+#include <stdbool.h>    /* For bool */
+#include <stdint.h>     /* For uint32_t */
+#include <stdlib.h>     /* For calloc/free */
+#include <string.h>     /* For memcmp/strlen */
+
+/* 3rd-party headers */
+#include <pthread.h>
+
+/* Our headers */
+#include "data_array.h"
+#include "data_freeze.h"
+#include "data_index.h"
+#include "data_rcu.h"
+
+typedef struct {
+    uint32_t hash;
+    bool has_duplicates;                /* Set if other indexed elements have the same name */
+    _Atomic(named_data_t *) element;    /* NULL if the entry is empty */
+    size_t index;                       /* Index of the element within the shard, only read under the lock */
+} data_index_entry_t;
+
+/* Entries for removed names point here */
+static named_data_t g_index_tombstone;
+
+typedef struct data_index_table {
+    size_t size;                    /* Size of index (in entries), a power of 2 */
+    size_t num_entries;             /* Number of entries in use, including tombstones */
+    _Atomic size_t num_indexed;     /* Number of the shard's elements added so far */
+    data_index_entry_t entries[];
+} data_index_table_t;
+
+/**
+ * @brief Hash an element name (32-bit FNV-1a).
+ *
+ * @param name      Element name.
+ * @param name_len  Length of the name.
+ * @return uint32_t Hash of the name.
+ */
+uint32_t data_name_hash(const char * name, size_t name_len) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < name_len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Find the entry for a name, or the empty entry where it would go.
+ *
+ * Tombstones are skipped.
+ *
+ * @param table     Index table to search.
+ * @param name      Element name.
+ * @param name_len  Length of the name.
+ * @param hash      Hash of the element name.
+ * @return data_index_entry_t*  Matching entry, or the first empty entry probed.
+ */
+static data_index_entry_t * find_entry(
+    data_index_table_t * table,
+    const char * name,
+    size_t name_len,
+    uint32_t hash)
+{
+    size_t mask = table->size - 1;
+    size_t i    = hash & mask;
+    named_data_t * element;
+
+    while (NULL != (element = atomic_load_explicit(&table->entries[i].element, memory_order_acquire))) {
+        const char * entry_name = data_element_name(element);
+
+        /* Interned names that match are always the same pointer. */
+        if (&g_index_tombstone != element &&
+            hash == table->entries[i].hash &&
+            name_len == element->name_len &&
+            (entry_name == name || 0 == memcmp(entry_name, name, name_len))) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return &table->entries[i];
+}
+
+/**
+ * @brief Add an element to an index table that has room for it.
+ *
+ * If an element with the same name is already indexed, that one is kept, and
+ * its entry notes that it has duplicates.
+ *
+ * @param table     Index table.
+ * @param element   Element to index.
+ * @param hash      Hash of the element's name.
+ * @param index     Index of the element within its shard.
+ * @return data_index_entry_t*  The entry for the element's name.
+ */
+static data_index_entry_t * insert_entry(data_index_table_t * table, named_data_t * element, uint32_t hash, size_t index) {
+    data_index_entry_t * entry;
+
+    entry = find_entry(table, data_element_name(element), element->name_len, hash);
+    if (NULL == atomic_load_explicit(&entry->element, memory_order_relaxed)) {
+        /* Lookups that see the element also see its hash. */
+        entry->hash  = hash;
+        entry->index = index;
+        atomic_store_explicit(&entry->element, element, memory_order_release);
+        table->num_entries += 1;
+    } else {
+        entry->has_duplicates = true;
+    }
+
+    return entry;
+}
+
+/**
+ * @brief Replace a shard's index table with one of `new_size` entries.
+ *
+ * The old table is retired, since lookups may still be searching it.
+ *
+ * @param shard     The shard.
+ * @param new_size  New size of the index (in entries), a power of 2.
+ * @return true     Index resized.
+ * @return false    Failed to allocate memory for the new index.
+ */
+static bool resize_index(data_shard_t * shard, size_t new_size) {
+    bool status = false;
+    data_index_table_t * table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    data_index_table_t * new_table;
+    size_t i;
+
+    new_table = calloc(1, sizeof(data_index_table_t) + new_size * sizeof(data_index_entry_t));
+    if (NULL == new_table) {
+        /* Out of memory! */
+        goto done;
+    }
+    new_table->size = new_size;
+
+    if (NULL != table) {
+        for (i = 0; i < table->size; i++) {
+            named_data_t * element = atomic_load_explicit(&table->entries[i].element, memory_order_relaxed);
+
+            if (NULL != element && &g_index_tombstone != element) {
+                data_index_entry_t * entry = insert_entry(new_table, element, table->entries[i].hash,
+                                                          table->entries[i].index);
+
+                entry->has_duplicates = table->entries[i].has_duplicates;
+            }
+        }
+        atomic_store_explicit(&new_table->num_indexed,
+                              atomic_load_explicit(&table->num_indexed, memory_order_relaxed),
+                              memory_order_relaxed);
+    }
+
+    /* Lookups that find the new table also find everything in it. */
+    atomic_store(&shard->index, new_table);
+    data_rcu_retire(table, free);
+
+    status = true;
+
+done:
+    return status;
+}
+
+/**
+ * @brief Add the elements appended to a shard since it was last indexed.
+ *
+ * The caller must hold the shard's lock.
+ *
+ * @param shard     The shard.
+ * @return true     Every element in the shard is indexed.
+ * @return false    Failed to grow the index. Some elements aren't indexed.
+ */
+bool data_index_update(data_shard_t * shard) {
+    size_t num_elements = atomic_load_explicit(&shard->num_elements, memory_order_acquire);
+    data_index_table_t * table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    size_t num_indexed = NULL != table ? atomic_load_explicit(&table->num_indexed, memory_order_relaxed) : 0;
+
+    while (num_indexed < num_elements) {
+        named_data_t * element = data_shard_element(shard, num_indexed);
+
+        if (NULL == table || (table->num_entries + 1) * 2 > table->size) {
+            /* Index is half full, double it to keep the probe sequences short. */
+            if (false == resize_index(shard, NULL != table ? table->size * 2 : DATA_INDEX_MIN_SIZE)) {
+                return false;
+            }
+            table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+        }
+
+        if (false == data_shard_removed(shard, num_indexed)) {
+            insert_entry(table, element, element->name_hash, num_indexed);
+        }
+        num_indexed += 1;
+        atomic_store_explicit(&table->num_indexed, num_indexed, memory_order_release);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Find the first element in a shard with the given name, to remove it.
+ *
+ * Brings the index up to date first, so that the element's entry says where
+ * it is. Only elements the index couldn't take, if it failed to grow, or that
+ * were added without the lock since, are checked one by one.
+ *
+ * The caller must hold the shard's lock.
+ *
+ * @param shard         The shard.
+ * @param name          Element name.
+ * @param name_len      Length of the name.
+ * @param hash          Hash of the name.
+ * @param[out] index    Index of the element within the shard.
+ * @return true         Found the element.
+ * @return false        No element in the shard has that name.
+ */
+bool data_index_find(data_shard_t * shard, const char * name, size_t name_len, uint32_t hash, size_t * index) {
+    data_index_table_t * table;
+    size_t num_indexed = 0;
+    size_t num_elements;
+
+    (void)data_index_update(shard);
+
+    table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    if (NULL != table) {
+        data_index_entry_t * entry = find_entry(table, name, name_len, hash);
+        named_data_t * element     = atomic_load_explicit(&entry->element, memory_order_relaxed);
+
+        if (NULL != element && &g_index_tombstone != element) {
+            *index = entry->index;
+            return true;
+        }
+        num_indexed = atomic_load_explicit(&table->num_indexed, memory_order_relaxed);
+    }
+
+    num_elements = atomic_load_explicit(&shard->num_elements, memory_order_acquire);
+    *index = find_data_element(shard, name, name_len, hash, num_indexed, num_elements);
+
+    return *index < num_elements;
+}
+
+/**
+ * @brief Check if removing an element means its index entry needs another
+ *        element with the same name.
+ *
+ * That's only so if the entry for the name is the element's, and other
+ * elements with the name were indexed after it. Elements that aren't indexed
+ * yet don't matter, since lookups check those one by one anyway. Most names
+ * are unique, so most removals can skip looking for the next element.
+ *
+ * The caller must hold the shard's lock.
+ *
+ * @param shard     The shard.
+ * @param element   The element being removed.
+ * @return true     Find the next element with the name for data_index_remove().
+ * @return false    data_index_remove() can be given NULL.
+ */
+bool data_index_has_duplicates(data_shard_t * shard, const named_data_t * element) {
+    data_index_table_t * table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    data_index_entry_t * entry;
+
+    if (NULL == table) {
+        return false;
+    }
+
+    entry = find_entry(table, data_element_name(element), element->name_len, element->name_hash);
+    return element == atomic_load_explicit(&entry->element, memory_order_relaxed) && entry->has_duplicates;
+}
+
+/**
+ * @brief Take an element that's being removed out of a shard's index.
+ *
+ * The caller must hold the shard's lock.
+ *
+ * @param shard         The shard.
+ * @param element       The element being removed.
+ * @param next_element  The next element added with the same name, or NULL.
+ * @param next_index    Index of the next element within the shard, if there is one.
+ */
+void data_index_remove(data_shard_t * shard, named_data_t * element, named_data_t * next_element, size_t next_index) {
+    data_index_table_t * table = atomic_load_explicit(&shard->index, memory_order_relaxed);
+    data_index_entry_t * entry;
+
+    if (NULL == table) {
+        return;
+    }
+
+    entry = find_entry(table, data_element_name(element), element->name_len, element->name_hash);
+    if (element == atomic_load_explicit(&entry->element, memory_order_relaxed)) {
+        entry->index = next_index;
+        atomic_store_explicit(&entry->element,
+                              NULL != next_element ? next_element : &g_index_tombstone,
+                              memory_order_release);
+    }
+}
+
+/**
+ * @brief Remove every element from a shard's index and retire it.
+ *
+ * The caller must hold the shard's lock.
+ *
+ * @param shard     The shard.
+ */
+void data_index_clear(data_shard_t * shard) {
+    data_rcu_retire(atomic_exchange(&shard->index, NULL), free);
+}
+
+/**
+ * @brief Look up an element in the global data array by name.
+ *
+ * Takes no lock, unless the shard's index has fallen far enough behind the
+ * elements appended to it that it's worth bringing up to date first.
+ *
+ * If other threads may be removing elements, call this from inside a read
+ * section (see data_rcu.h), and only use the element until it ends.
+ *
+ * @param name              Element name.
+ * @return named_data_t*    First element added with that name.
+ * @return NULL             No element has that name.
+ */
+named_data_t * lookup_data_element(const char * name) {
+    named_data_t * element = NULL;
+    data_index_table_t * table;
+    data_shard_t * shard;
+    size_t num_elements;
+    size_t num_indexed = 0;
+    size_t name_len;
+    uint32_t hash;
+    size_t i;
+
+    if (NULL == name) {
+        /* Bad args! */
+        return NULL;
+    }
+    name_len = strlen(name);
+    if (name_len >= DATA_NAME_REMOVED) {
+        /* No element has a name this long. */
+        return NULL;
+    }
+
+    data_rcu_read_lock();
+
+    if (true == lookup_frozen_data_element(name, name_len, &element)) {
+        /* The array is frozen, so the snapshot has everything. */
+        goto unlock;
+    }
+
+    hash  = data_name_hash(name, name_len);
+    shard = data_array_shard(hash);
+
+    table = atomic_load_explicit(&shard->index, memory_order_acquire);
+    if (NULL != table) {
+        num_indexed = atomic_load_explicit(&table->num_indexed, memory_order_acquire);
+    }
+    num_elements = atomic_load_explicit(&shard->num_elements, memory_order_acquire);
+
+    if (num_elements - num_indexed > DATA_INDEX_MAX_LAG) {
+        /* Lock the shard so we can safely bring its index up to date. */
+        data_lock_acquire(&shard->lock);
+        (void)data_index_update(shard);
+        data_lock_release(&shard->lock);
+
+        table = atomic_load_explicit(&shard->index, memory_order_acquire);
+        if (NULL != table) {
+            num_indexed = atomic_load_explicit(&table->num_indexed, memory_order_acquire);
+        }
+    }
+
+    /*
+     * Everything in the index was added before everything that isn't, so if
+     * the name is in the index, that's the first element with it.
+     */
+    if (NULL != table) {
+        element = atomic_load_explicit(&find_entry(table, name, name_len, hash)->element, memory_order_acquire);
+        if (&g_index_tombstone == element) {
+            /* It was removed after we found it. */
+            element = NULL;
+        }
+    }
+
+    /* Check the elements the index doesn't have yet one by one. */
+    for (i = num_indexed; NULL == element && i < num_elements; i++) {
+        size_t offset;
+        size_t segment = data_array_locate(i, &offset);
+
+        /* Removed elements never match, since no name is that long. */
+        if (hash == data_segment_hashes(shard, segment)[offset] &&
+            name_len == atomic_load_explicit(&data_segment_name_lens(shard, segment)[offset],
+                                             memory_order_relaxed) &&
+            0 == memcmp(data_element_name(data_shard_element(shard, i)), name, name_len)) {
+            element = data_shard_element(shard, i);
+        }
+    }
+
+unlock:
+    data_rcu_read_unlock();
+
+    return element;
+}
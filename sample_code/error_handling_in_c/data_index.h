@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Hash index over each shard of the global data array, for looking elements
+ * up by name.
+ */
+
+#ifndef DATA_INDEX_H
+#define DATA_INDEX_H
+
+#include <stdbool.h>    /* For bool */
+#include <stddef.h>     /* For size_t */
+#include <stdint.h>     /* For uint32_t */
+
+#include "data_array.h"
+
+/* The index is resized to keep it at most half full */
+#define DATA_INDEX_MIN_SIZE 256
+
+/* Lookups bring the index up to date once it's missing more elements than this */
+#define DATA_INDEX_MAX_LAG 64
+
+uint32_t data_name_hash(const char * name, size_t name_len);
+
+/*
+ * The caller must hold the shard's lock for these.
+ */
+bool data_index_update(data_shard_t * shard);
+bool data_index_find(data_shard_t * shard, const char * name, size_t name_len, uint32_t hash, size_t * index);
+bool data_index_has_duplicates(data_shard_t * shard, const named_data_t * element);
+void data_index_remove(data_shard_t * shard, named_data_t * element, named_data_t * next_element, size_t next_index);
+void data_index_clear(data_shard_t * shard);
+
+named_data_t * lookup_data_element(const char * name);
+
+#endif /* DATA_INDEX_H */
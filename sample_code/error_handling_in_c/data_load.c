@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Bulk loading of named data elements into the global data array, on a pool
+ * of threads.
+ *
+ * The elements are split into batches of DATA_LOAD_BATCH_SZ, and each thread
+ * starts out with an even share of the batches. A thread copies the names of
+ * a batch into elements of its own, without any lock, and then stores the
+ * whole batch with store_data_elements(), which locks each shard it touches
+ * once. The array is grown once up front to fit everything, so the batches
+ * rarely have to grow it.
+ *
+ * A thread that runs out of batches steals them from the far end of another
+ * thread's share, so threads that fall behind (on a slow core, or because
+ * they couldn't be started at all) don't hold up the load.
+ *
+ * The threads are started for each load and joined before it returns, the
+ * same as teardown_data_array() does. A load is meant to add a great many
+ * elements at once, so starting the threads costs little next to it, and
+ * there's no pool to keep alive between loads or to shut down with the array.
+ */
+
+/* Standard headers */
+#include <stdatomic.h>  /* For atomic_load/atomic_compare_exchange_weak */
+#include <stdbool.h>    /* For bool */
+#include <stdint.h>     /* For uint32_t/uint64_t */
+#include <string.h>     /* For memset */
+
+/* 3rd-party headers */
+#include <pthread.h>
+
+/* Our headers */
+#include "data_array.h"
+#include "data_freeze.h"
+#include "data_load.h"
+
+struct data_load_job;
+
+typedef struct {
+    /*
+     * The batches this thread has left: the next one it will take in the low
+     * half, and the end of its share in the high half. The thread takes them
+     * from the front, and other threads steal them from the back.
+     */
+    _Alignas(DATA_SHARD_ALIGN) _Atomic uint64_t batches;
+    pthread_t thread;
+    size_t number;
+    struct data_load_job * job;
+} data_load_worker_t;
+
+typedef struct data_load_job {
+    const char * const * names;
+    void * const * datas;
+    size_t num_elements;
+    size_t num_workers;
+    _Atomic bool failed;    /* Set if any element couldn't be added */
+    data_load_worker_t workers[DATA_LOAD_MAX_THREADS];
+} data_load_job_t;
+
+/**
+ * @brief Pack a range of batches into a worker's batches.
+ *
+ * @param next      The first batch in the range.
+ * @param end       The batch after the last one.
+ * @return uint64_t The packed range.
+ */
+static uint64_t pack_batches(uint32_t next, uint32_t end) {
+    return ((uint64_t)end << 32) | next;
+}
+
+/**
+ * @brief Take the next batch from the front of a worker's share.
+ *
+ * @param worker        The worker taking the batch, which owns the share.
+ * @param[out] batch    The batch taken.
+ * @return true         Took a batch.
+ * @return false        The worker's share is empty.
+ */
+static bool take_batch(data_load_worker_t * worker, size_t * batch) {
+    uint64_t batches = atomic_load(&worker->batches);
+    uint32_t next;
+    uint32_t end;
+
+    do {
+        next = (uint32_t)batches;
+        end  = (uint32_t)(batches >> 32);
+        if (next >= end) {
+            return false;
+        }
+    } while (false == atomic_compare_exchange_weak(&worker->batches, &batches, pack_batches(next + 1, end)));
+
+    *batch = next;
+    return true;
+}
+
+/**
+ * @brief Steal the last batch from the back of another worker's share.
+ *
+ * @param victim        The worker to steal from.
+ * @param[out] batch    The batch stolen.
+ * @return true         Stole a batch.
+ * @return false        The worker's share is empty.
+ */
+static bool steal_batch(data_load_worker_t * victim, size_t * batch) {
+    uint64_t batches = atomic_load(&victim->batches);
+    uint32_t next;
+    uint32_t end;
+
+    do {
+        next = (uint32_t)batches;
+        end  = (uint32_t)(batches >> 32);
+        if (next >= end) {
+            return false;
+        }
+    } while (false == atomic_compare_exchange_weak(&victim->batches, &batches, pack_batches(next, end - 1)));
+
+    *batch = end - 1;
+    return true;
+}
+
+/**
+ * @brief Copy the names of a batch, and store its elements.
+ *
+ * @param job       The load.
+ * @param batch     The batch number.
+ */
+static void load_batch(data_load_job_t * job, size_t batch) {
+    named_data_t elements[DATA_LOAD_BATCH_SZ];
+    size_t first = batch * DATA_LOAD_BATCH_SZ;
+    size_t num_names = job->num_elements - first < DATA_LOAD_BATCH_SZ ? job->num_elements - first
+                                                                      : DATA_LOAD_BATCH_SZ;
+    size_t num_built = 0;
+    size_t num_kept;
+    size_t i;
+
+    for (i = 0; i < num_names; i++) {
+        named_data_t * element = &elements[num_built];
+
+        memset(element, 0, sizeof(named_data_t));
+
+        if (NULL == job->names[first + i] || NULL == job->datas[first + i]) {
+            /* Bad args! */
+            atomic_store(&job->failed, true);
+            continue;
+        }
+
+        /* We don't own the name, so let's copy it. */
+        if (false == set_data_element_name(element, job->names[first + i])) {
+            /* Out of memory! */
+            atomic_store(&job->failed, true);
+            continue;
+        }
+
+        /* We're given ownership of the data, so we'll assign the pointer. */
+        element->data = job->datas[first + i];
+
+        num_built += 1;
+    }
+
+    num_kept = store_data_elements(elements, num_built, NULL);
+    if (0 != num_kept) {
+        /* Out of memory, or frozen! We still own the names that weren't stored. */
+        atomic_store(&job->failed, true);
+        for (i = 0; i < num_kept; i++) {
+            free_data_element_name(&elements[i]);
+        }
+    }
+}
+
+/**
+ * @brief Load batches until every worker's share is empty.
+ *
+ * @param arg       The data_load_worker_t for this thread.
+ * @return void*    NULL. Failures are recorded in the job.
+ */
+static void * load_worker(void * arg) {
+    data_load_worker_t * worker = arg;
+    data_load_job_t * job = worker->job;
+    size_t batch;
+    size_t i;
+
+    for (;;) {
+        if (true == take_batch(worker, &batch)) {
+            load_batch(job, batch);
+            continue;
+        }
+
+        /* Our share is done, help whoever still has batches left. */
+        for (i = 1; i < job->num_workers; i++) {
+            if (true == steal_batch(&job->workers[(worker->number + i) % job->num_workers], &batch)) {
+                break;
+            }
+        }
+        if (i == job->num_workers) {
+            /* Nobody has any left, and no more are ever added. */
+            break;
+        }
+        load_batch(job, batch);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Add many named data elements to the global array at once.
+ *
+ * Elements are added on up to `num_threads` threads, counting the caller.
+ * With one thread, they're added in order. With more, elements that go in
+ * the same shard may be added in any order, so if names repeat, which of them
+ * lookup_data_element() finds isn't fixed.
+ *
+ * No other thread may free the array while this runs.
+ *
+ * @param names         NULL-terminated name of each element.
+ * @param datas         Pointer to the data of each element. We're given ownership of the data.
+ * @param num_elements  Number of elements.
+ * @param num_threads   Threads to add elements on. 0 means 1.
+ * @return true         Every element added.
+ * @return false        Failed to add some of the elements. The rest were added.
+ */
+bool load_data_elements(const char * const * names, void * const * datas, size_t num_elements, size_t num_threads) {
+    bool status = false;
+    data_load_job_t job;
+    size_t num_batches;
+    size_t num_started = 1;
+    size_t i;
+
+    if (NULL == names || NULL == datas) {
+        /* Bad args! */
+        goto done;
+    }
+
+    num_batches = num_elements / DATA_LOAD_BATCH_SZ + (0 != num_elements % DATA_LOAD_BATCH_SZ);
+    if (num_batches > UINT32_MAX) {
+        /* Too many batches to keep track of! */
+        goto done;
+    }
+
+    if (data_array_frozen()) {
+        /* No appends until the array is unfrozen! */
+        goto done;
+    }
+
+    if (0 == num_threads) {
+        num_threads = 1;
+    }
+    if (num_threads > DATA_LOAD_MAX_THREADS) {
+        num_threads = DATA_LOAD_MAX_THREADS;
+    }
+    if (num_threads > num_batches) {
+        num_threads = 0 != num_batches ? num_batches : 1;
+    }
+
+    /*
+     * Grow the array once for the whole load. The slots of removed elements
+     * aren't free until the array is compacted, so count them as used. If this
+     * fails, the batches grow it themselves.
+     */
+    (void)reserve_data_array(data_array_used_slots() + num_elements);
+
+    job.names        = names;
+    job.datas        = datas;
+    job.num_elements = num_elements;
+    job.num_workers  = num_threads;
+    atomic_init(&job.failed, false);
+
+    /* Give each thread an even share of the batches. */
+    for (i = 0; i < num_threads; i++) {
+        job.workers[i].number = i;
+        job.workers[i].job    = &job;
+        atomic_init(&job.workers[i].batches,
+                    pack_batches((uint32_t)(num_batches * i / num_threads),
+                                 (uint32_t)(num_batches * (i + 1) / num_threads)));
+    }
+
+    /* We're the first worker. The rest get threads of their own. */
+    for (i = 1; i < num_threads; i++) {
+        if (0 != pthread_create(&job.workers[i].thread, NULL, load_worker, &job.workers[i])) {
+            /* The others will steal this one's share. */
+            break;
+        }
+        num_started += 1;
+    }
+    (void)load_worker(&job.workers[0]);
+
+    for (i = 1; i < num_started; i++) {
+        pthread_join(job.workers[i].thread, NULL);
+    }
+
+    status = (false == atomic_load(&job.failed));
+
+done:
+    return status;
+}
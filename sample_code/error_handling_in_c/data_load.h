@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Bulk loading of named data elements into the global data array, on a pool
+ * of threads.
+ */
+
+#ifndef DATA_LOAD_H
+#define DATA_LOAD_H
+
+#include <stdbool.h>    /* For bool */
+#include <stddef.h>     /* For size_t */
+
+/* Loader threads take the elements to add in batches of this many */
+#ifndef DATA_LOAD_BATCH_SZ
+#define DATA_LOAD_BATCH_SZ 1024
+#endif
+
+/* Most threads load_data_elements() will add elements on */
+#ifndef DATA_LOAD_MAX_THREADS
+#define DATA_LOAD_MAX_THREADS 64
+#endif
+
+bool load_data_elements(const char * const * names, void * const * datas, size_t num_elements, size_t num_threads);
+
+#endif /* DATA_LOAD_H */
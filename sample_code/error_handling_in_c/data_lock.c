@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * The lock that guards each shard of the global data array.
+ *
+ * Shard locks are held for a few stores at a time, so when one is taken, it's
+ * usually free again by the time a waiter would have gone to sleep. The futex
+ * lock (DATA_LOCK_FUTEX=1) spins for DATA_LOCK_SPIN_COUNT checks before it
+ * sleeps, so short waits never enter the kernel. It's the three-state mutex
+ * from Ulrich Drepper's "Futexes Are Tricky": unlocking only makes a system
+ * call if someone might be asleep.
+ *
+ * The default is a pthread mutex, so the two can be compared. Both keep the
+ * same statistics. Waits are only timed when the lock isn't free on the first
+ * try, so uncontended locking doesn't pay for the clock.
+ */
+
+/* Standard headers */
+#include <stdatomic.h>  /* For atomic_load_explicit/atomic_store_explicit */
+#include <stdint.h>     /* For uint32_t/uint64_t */
+#include <time.h>       /* For clock_gettime */
+
+/* 3rd-party headers */
+#include <pthread.h>
+#include <sched.h>      /* For sched_yield */
+
+#if DATA_LOCK_FUTEX && defined(__linux__)
+#include <linux/futex.h>    /* For FUTEX_WAIT_PRIVATE/FUTEX_WAKE_PRIVATE */
+#include <sys/syscall.h>    /* For SYS_futex */
+#include <unistd.h>         /* For syscall */
+#endif
+
+/* Our headers */
+#include "data_lock.h"
+
+/**
+ * @brief Get a monotonic timestamp.
+ *
+ * @return uint64_t     Time in nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Add to one of a lock's counters. The caller must hold the lock.
+ *
+ * Nobody else changes the counter, so there's no need for an atomic add.
+ *
+ * @param counter   The counter.
+ * @param value     Amount to add.
+ */
+static void add_to_counter(_Atomic uint64_t * counter, uint64_t value) {
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+#if DATA_LOCK_FUTEX
+
+/**
+ * @brief Tell the CPU we're spinning, so it can go easy on its sibling thread.
+ */
+static inline void spin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * @brief Sleep until the lock's state might not be `state` anymore.
+ *
+ * @param lock      The lock.
+ * @param state     The state we saw.
+ */
+static void park(data_lock_t * lock, uint32_t state) {
+#if defined(__linux__)
+    syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+#else
+    (void)lock;
+    (void)state;
+    sched_yield();
+#endif
+}
+
+/**
+ * @brief Wake one thread sleeping on the lock.
+ *
+ * @param lock      The lock.
+ */
+static void unpark(data_lock_t * lock) {
+#if defined(__linux__)
+    syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void)lock;
+#endif
+}
+
+#endif /* DATA_LOCK_FUTEX */
+
+/**
+ * @brief Initialize a lock.
+ *
+ * @param lock      The lock.
+ */
+void data_lock_init(data_lock_t * lock) {
+#if DATA_LOCK_FUTEX
+    atomic_init(&lock->state, 0);
+#else
+    pthread_mutex_init(&lock->mutex, NULL);
+#endif
+    atomic_init(&lock->acquisitions, 0);
+    atomic_init(&lock->contended, 0);
+    atomic_init(&lock->wait_ns, 0);
+}
+
+/**
+ * @brief Take a lock, waiting for it if need be.
+ *
+ * @param lock      The lock.
+ */
+void data_lock_acquire(data_lock_t * lock) {
+    uint64_t start;
+
+#if DATA_LOCK_FUTEX
+    uint32_t state = 0;
+    int spins;
+
+    if (atomic_compare_exchange_strong_explicit(&lock->state, &state, 1,
+                                                memory_order_acquire, memory_order_relaxed)) {
+        /* Fast path, the lock was free. */
+        add_to_counter(&lock->acquisitions, 1);
+        return;
+    }
+
+    start = now_ns();
+
+    /* Spin a while, in case the holder is about to let go. */
+    for (spins = 0; spins < DATA_LOCK_SPIN_COUNT; spins++) {
+        spin_pause();
+
+        state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+        if (0 == state &&
+            atomic_compare_exchange_weak_explicit(&lock->state, &state, 1,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            goto locked;
+        }
+    }
+
+    /*
+     * Still held, so sleep. Mark the lock as having a sleeper first, so that
+     * whoever unlocks it wakes us. Since we can't tell whether anyone else is
+     * asleep, we keep that mark when we do get the lock.
+     */
+    while (0 != atomic_exchange_explicit(&lock->state, 2, memory_order_acquire)) {
+        park(lock, 2);
+    }
+
+locked:
+#else
+    if (0 == pthread_mutex_trylock(&lock->mutex)) {
+        /* Fast path, the lock was free. */
+        add_to_counter(&lock->acquisitions, 1);
+        return;
+    }
+
+    start = now_ns();
+
+    pthread_mutex_lock(&lock->mutex);
+#endif
+
+    add_to_counter(&lock->acquisitions, 1);
+    add_to_counter(&lock->contended, 1);
+    add_to_counter(&lock->wait_ns, now_ns() - start);
+}
+
+/**
+ * @brief Let go of a lock.
+ *
+ * @param lock      The lock. The caller must hold it.
+ */
+void data_lock_release(data_lock_t * lock) {
+#if DATA_LOCK_FUTEX
+    if (2 == atomic_exchange_explicit(&lock->state, 0, memory_order_release)) {
+        /* Someone may be asleep, wake one of them. */
+        unpark(lock);
+    }
+#else
+    pthread_mutex_unlock(&lock->mutex);
+#endif
+}
+
+/**
+ * @brief Add a lock's statistics to a running total.
+ *
+ * @param lock          The lock. The caller needn't hold it.
+ * @param[in,out] stats Totals to add to.
+ */
+void data_lock_add_stats(const data_lock_t * lock, data_lock_stats_t * stats) {
+    stats->acquisitions += atomic_load_explicit(&lock->acquisitions, memory_order_relaxed);
+    stats->contended    += atomic_load_explicit(&lock->contended, memory_order_relaxed);
+    stats->wait_ns      += atomic_load_explicit(&lock->wait_ns, memory_order_relaxed);
+}
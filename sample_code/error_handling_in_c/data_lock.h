@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * The lock that guards each shard of the global data array.
+ */
+
+#ifndef DATA_LOCK_H
+#define DATA_LOCK_H
+
+#include <stdatomic.h>  /* For _Atomic */
+#include <stdint.h>     /* For uint32_t/uint64_t */
+
+/* 3rd-party Libs */
+#include <pthread.h>
+
+/*
+ * Build with DATA_LOCK_FUTEX=1 to use a lock that spins for a while before it
+ * sleeps on a futex, instead of a pthread mutex. Either way, the lock counts
+ * how often it was taken, how often it had to wait, and for how long.
+ */
+#ifndef DATA_LOCK_FUTEX
+#define DATA_LOCK_FUTEX 0
+#endif
+
+/* How many times the futex lock checks if it's free before it sleeps */
+#ifndef DATA_LOCK_SPIN_COUNT
+#define DATA_LOCK_SPIN_COUNT 100
+#endif
+
+typedef struct {
+    uint64_t acquisitions;  /* Times the lock was taken */
+    uint64_t contended;     /* Times the lock was taken after waiting for it */
+    uint64_t wait_ns;       /* Time spent waiting for the lock (in nanoseconds) */
+} data_lock_stats_t;
+
+typedef struct {
+#if DATA_LOCK_FUTEX
+    _Atomic uint32_t state; /* 0: unlocked, 1: locked, 2: locked and someone may be asleep */
+#else
+    pthread_mutex_t mutex;
+#endif
+    /* Only changed by whoever holds the lock, but may be read at any time */
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_ns;
+} data_lock_t;
+
+void data_lock_init(data_lock_t * lock);
+void data_lock_acquire(data_lock_t * lock);
+void data_lock_release(data_lock_t * lock);
+
+void data_lock_add_stats(const data_lock_t * lock, data_lock_stats_t * stats);
+
+#endif /* DATA_LOCK_H */
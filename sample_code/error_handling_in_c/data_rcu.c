@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Read-copy-update for the parts of the data array that get replaced.
+ *
+ * Readers take no lock. Between data_rcu_read_lock() and data_rcu_read_unlock()
+ * they may use anything they find through a pointer that a writer might swap
+ * out from under them, such as a shard's index table. A writer that swaps one
+ * out passes the old one to data_rcu_retire() instead of freeing it, and it's
+ * freed once every reader that might have seen it is done.
+ *
+ * Time is counted in epochs. Each thread has a reader record, holding the
+ * epoch it started reading in, or 0 while it isn't reading. Retiring something
+ * stamps it with the current epoch, and puts it on the retiring thread's own
+ * list, so retiring takes no lock. Once a thread has retired DATA_RCU_BATCH
+ * things, it starts a new epoch and frees every one on its list that is
+ * stamped with an epoch before the oldest reader's, since those can't be in
+ * use. Nobody waits for a grace period to end, except data_rcu_synchronize().
+ *
+ * A writer that has to change what readers see in place, rather than swap it
+ * out, can shut readers out instead, with data_rcu_exclude_readers(). Threads
+ * that start reading meanwhile wait outside their read section until it's
+ * done, and it waits for the ones already reading.
+ */
+
+/* Standard headers */
+#include <stdatomic.h>  /* For atomic_load/atomic_store */
+#include <stdbool.h>    /* For bool */
+#include <stdint.h>     /* For uint64_t */
+#include <stdlib.h>     /* For malloc/free */
+
+/* 3rd-party headers */
+#include <pthread.h>
+#include <sched.h>      /* For sched_yield */
+
+/* Our headers */
+#include "data_rcu.h"
+
+typedef struct data_rcu_retired {
+    struct data_rcu_retired * next;
+    uint64_t epoch;             /* Epoch it was retired in */
+    void * ptr;
+    data_rcu_free_t free_fn;
+} data_rcu_retired_t;
+
+typedef struct data_rcu_reader {
+    struct data_rcu_reader * next;
+    _Atomic uint64_t epoch;     /* Epoch this thread started reading in, or 0 */
+    _Atomic bool in_use;        /* False once the thread that had it exits */
+    size_t depth;               /* Read sections this thread is nested in */
+    size_t num_retired;         /* Things retired since this thread's list was last reclaimed */
+
+    /*
+     * What this thread has retired. Whoever reclaims the list takes all of it
+     * at once, so a thread that has exited leaves its list for others.
+     */
+    _Atomic(data_rcu_retired_t *) retired;
+} data_rcu_reader_t;
+
+static _Atomic uint64_t g_rcu_epoch = 1;
+
+/* Set if a reader ever couldn't get a record, so nothing retired is safe to free */
+static _Atomic bool g_rcu_unsafe = false;
+
+/* Number of writers shutting readers out, see data_rcu_exclude_readers() */
+static _Atomic size_t g_rcu_excluding = 0;
+
+/* Every reader record ever made. They're reused, but never freed. */
+static _Atomic(data_rcu_reader_t *) g_rcu_readers = NULL;
+
+static pthread_once_t g_rcu_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_rcu_key;
+
+static _Thread_local data_rcu_reader_t * t_rcu_reader = NULL;
+
+/**
+ * @brief Give up a thread's reader record when the thread exits.
+ *
+ * @param reader    The reader record.
+ */
+static void release_reader(void * reader) {
+    atomic_store(&((data_rcu_reader_t *)reader)->epoch, 0);
+    atomic_store(&((data_rcu_reader_t *)reader)->in_use, false);
+}
+
+/**
+ * @brief Make the key used to find out when threads exit.
+ */
+static void create_reader_key(void) {
+    pthread_key_create(&g_rcu_key, release_reader);
+}
+
+/**
+ * @brief Get this thread's reader record, claiming one on first use.
+ *
+ * @return data_rcu_reader_t*   The reader record.
+ * @return NULL                 Out of memory.
+ */
+static data_rcu_reader_t * get_reader(void) {
+    data_rcu_reader_t * reader;
+
+    if (NULL != t_rcu_reader) {
+        return t_rcu_reader;
+    }
+
+    pthread_once(&g_rcu_key_once, create_reader_key);
+
+    /* Reuse the record of a thread that has exited, if there is one. */
+    for (reader = atomic_load(&g_rcu_readers); NULL != reader; reader = reader->next) {
+        bool in_use = false;
+
+        if (atomic_compare_exchange_strong(&reader->in_use, &in_use, true)) {
+            break;
+        }
+    }
+
+    if (NULL == reader) {
+        reader = calloc(1, sizeof(data_rcu_reader_t));
+        if (NULL == reader) {
+            /* Out of memory! */
+            return NULL;
+        }
+        atomic_store(&reader->in_use, true);
+
+        reader->next = atomic_load(&g_rcu_readers);
+        while (false == atomic_compare_exchange_weak(&g_rcu_readers, &reader->next, reader)) {
+            /* Someone else added a record, try again. */
+        }
+    }
+
+    pthread_setspecific(g_rcu_key, reader);
+    t_rcu_reader = reader;
+    return reader;
+}
+
+/**
+ * @brief Wait until no writer is shutting readers out.
+ */
+static void wait_for_readers_admitted(void) {
+    while (0 != atomic_load(&g_rcu_excluding)) {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Start reading.
+ *
+ * Read sections may nest. Anything retired after this won't be freed until
+ * the matching data_rcu_read_unlock(). If a writer is shutting readers out,
+ * this waits until it's done, unless it's nested in a read section already.
+ */
+void data_rcu_read_lock(void) {
+    data_rcu_reader_t * reader = get_reader();
+
+    if (NULL == reader) {
+        /* Out of memory! Fall back to never freeing anything retired, or shutting readers out. */
+        atomic_store(&g_rcu_unsafe, true);
+        wait_for_readers_admitted();
+        return;
+    }
+
+    if (0 == reader->depth++) {
+        for (;;) {
+            atomic_store(&reader->epoch, atomic_load(&g_rcu_epoch));
+
+            /* Writers that can't see our epoch yet can't have retired what we read next. */
+            atomic_thread_fence(memory_order_seq_cst);
+
+            /* ...and writers that can are waiting for us, unless we see them first. */
+            if (0 == atomic_load(&g_rcu_excluding)) {
+                break;
+            }
+            atomic_store(&reader->epoch, 0);
+            wait_for_readers_admitted();
+        }
+    }
+}
+
+/**
+ * @brief Stop reading.
+ */
+void data_rcu_read_unlock(void) {
+    data_rcu_reader_t * reader = t_rcu_reader;
+
+    if (NULL != reader && 0 == --reader->depth) {
+        atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+    }
+}
+
+/**
+ * @brief Start a new epoch, and find the oldest epoch a reader is still in.
+ *
+ * @return uint64_t     Oldest reader's epoch. Anything retired before it is safe to free.
+ */
+static uint64_t advance_epoch(void) {
+    data_rcu_reader_t * reader;
+    uint64_t oldest;
+
+    /* Readers that start from now on can't find anything retired so far. */
+    oldest = atomic_fetch_add(&g_rcu_epoch, 1) + 1;
+
+    for (reader = atomic_load(&g_rcu_readers); NULL != reader; reader = reader->next) {
+        uint64_t epoch = atomic_load(&reader->epoch);
+
+        if (0 != epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    return oldest;
+}
+
+/**
+ * @brief Free what a thread has retired that no reader can still be using.
+ *
+ * The rest goes back on the thread's list.
+ *
+ * @param reader    Reader record of the thread that retired it.
+ * @param oldest    Oldest epoch a reader is still in, from advance_epoch().
+ */
+static void reclaim_list(data_rcu_reader_t * reader, uint64_t oldest) {
+    data_rcu_retired_t * retired = atomic_exchange(&reader->retired, NULL);
+    data_rcu_retired_t * kept = NULL;
+    data_rcu_retired_t * last_kept = NULL;
+
+    while (NULL != retired) {
+        data_rcu_retired_t * next = retired->next;
+
+        if (retired->epoch < oldest) {
+            retired->free_fn(retired->ptr);
+            free(retired);
+        } else {
+            /* Someone may still be reading it. */
+            retired->next = kept;
+            kept = retired;
+            if (NULL == last_kept) {
+                last_kept = retired;
+            }
+        }
+        retired = next;
+    }
+
+    if (NULL != kept) {
+        last_kept->next = atomic_load(&reader->retired);
+        while (false == atomic_compare_exchange_weak(&reader->retired, &last_kept->next, kept)) {
+            /* The thread retired something else meanwhile, try again. */
+        }
+    }
+}
+
+/**
+ * @brief Free whatever any thread has retired that no reader can still be using.
+ */
+void data_rcu_reclaim(void) {
+    data_rcu_reader_t * reader;
+    uint64_t oldest;
+
+    if (atomic_load(&g_rcu_unsafe)) {
+        return;
+    }
+
+    oldest = advance_epoch();
+
+    for (reader = atomic_load(&g_rcu_readers); NULL != reader; reader = reader->next) {
+        reclaim_list(reader, oldest);
+    }
+}
+
+/**
+ * @brief Wait until every reader that started before now is done, then free
+ *        everything retired so far.
+ *
+ * Must not be called from inside a read section, or while holding a lock that
+ * a reader might be waiting for.
+ */
+void data_rcu_synchronize(void) {
+    data_rcu_reader_t * reader;
+    uint64_t epoch = atomic_fetch_add(&g_rcu_epoch, 1);
+
+    for (reader = atomic_load(&g_rcu_readers); NULL != reader; reader = reader->next) {
+        uint64_t reader_epoch;
+
+        while (0 != (reader_epoch = atomic_load(&reader->epoch)) && reader_epoch <= epoch) {
+            sched_yield();
+        }
+    }
+
+    data_rcu_reclaim();
+}
+
+/**
+ * @brief Shut readers out, and wait for the ones already reading to finish.
+ *
+ * Until data_rcu_admit_readers(), threads that start reading wait for it
+ * first, so the caller can change what readers would see in place. Must not
+ * be called while holding a lock that a reader might be waiting for.
+ *
+ * @return true     No thread is reading. Call data_rcu_admit_readers() when done.
+ * @return false    Called from inside a read section, where it would wait for
+ *                  itself, or a reader once ran without a record, so it can't
+ *                  be waited for. Readers aren't shut out.
+ */
+bool data_rcu_exclude_readers(void) {
+    if (NULL != t_rcu_reader && 0 != t_rcu_reader->depth) {
+        /* We're reading ourselves! */
+        return false;
+    }
+
+    atomic_fetch_add(&g_rcu_excluding, 1);
+    data_rcu_synchronize();
+
+    if (atomic_load(&g_rcu_unsafe)) {
+        /* Readers without a record may be reading, and we can't tell. */
+        data_rcu_admit_readers();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Let readers in again after data_rcu_exclude_readers().
+ */
+void data_rcu_admit_readers(void) {
+    atomic_fetch_sub(&g_rcu_excluding, 1);
+}
+
+/**
+ * @brief Free something once every reader that might be using it is done.
+ *
+ * The caller must already have made sure no new reader can find it.
+ *
+ * @param ptr       The memory to free.
+ * @param free_fn   Function that frees it.
+ */
+void data_rcu_retire(void * ptr, data_rcu_free_t free_fn) {
+    data_rcu_reader_t * reader;
+    data_rcu_retired_t * retired;
+
+    if (NULL == ptr) {
+        return;
+    }
+
+    reader  = get_reader();
+    retired = malloc(sizeof(data_rcu_retired_t));
+    if (NULL == reader || NULL == retired) {
+        /* Out of memory! Leak it rather than free it too soon. */
+        free(retired);
+        return;
+    }
+    retired->ptr     = ptr;
+    retired->free_fn = free_fn;
+
+    /* Readers that can find it are in this epoch or an earlier one. */
+    atomic_thread_fence(memory_order_seq_cst);
+    retired->epoch = atomic_load(&g_rcu_epoch);
+    retired->next  = atomic_load(&reader->retired);
+    while (false == atomic_compare_exchange_weak(&reader->retired, &retired->next, retired)) {
+        /* Someone is reclaiming our list, try again. */
+    }
+
+    reader->num_retired += 1;
+    if (reader->num_retired >= DATA_RCU_BATCH && false == atomic_load(&g_rcu_unsafe)) {
+        reader->num_retired = 0;
+        reclaim_list(reader, advance_epoch());
+    }
+}
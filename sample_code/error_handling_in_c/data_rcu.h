@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Read-copy-update for the parts of the data array that get replaced.
+ */
+
+#ifndef DATA_RCU_H
+#define DATA_RCU_H
+
+#include <stdbool.h>    /* For bool */
+
+/* Each thread frees what it has retired in batches of this many */
+#ifndef DATA_RCU_BATCH
+#define DATA_RCU_BATCH 64
+#endif
+
+/**
+ * @brief Frees memory once no reader can be using it.
+ *
+ * @param ptr   The memory.
+ */
+typedef void (*data_rcu_free_t)(void * ptr);
+
+void data_rcu_read_lock(void);
+void data_rcu_read_unlock(void);
+
+void data_rcu_retire(void * ptr, data_rcu_free_t free_fn);
+void data_rcu_reclaim(void);
+void data_rcu_synchronize(void);
+
+bool data_rcu_exclude_readers(void);
+void data_rcu_admit_readers(void);
+
+#endif /* DATA_RCU_H */
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Bump allocator for element names.
+ *
+ * Each thread carves names out of its own block, so allocating a name takes no
+ * lock. A lock is only needed to add a new block to the list of all blocks.
+ *
+ * Names aren't freed one at a time. Instead, each block counts the names in it
+ * that are still in use, plus one while its thread is still carving names out
+ * of it. Releasing the last of them frees the block, so the names of removed
+ * elements don't pile up. A thread lets go of its block when it exits, too.
+ * name_arena_reset() frees every block that's left at once when the data array
+ * is freed.
+ *
+ * Names that were allocated with malloc() elsewhere can be adopted by the
+ * elements they name, rather than copied into the arena. Each one is freed
+ * with free() by whoever lets go of its element. The arena only counts them,
+ * so that name_arena_bytes() covers every long name.
+ */
+
+/* Standard headers */
+#include <stdatomic.h>  /* For atomic_fetch_add_explicit/atomic_load_explicit */
+#include <stdbool.h>    /* For bool */
+#include <stdlib.h>     /* For malloc/free */
+
+/* 3rd-party headers */
+#include <pthread.h>
+
+/* Our headers */
+#include "name_arena.h"
+
+struct name_arena_block {
+    struct name_arena_block * next;
+    struct name_arena_block * prev;
+    _Atomic size_t num_names;   /* Names in use, plus one while its thread carves more */
+    size_t size;                /* Size of data (in bytes) */
+    size_t used;                /* Bytes of data handed out */
+    char data[];
+};
+
+static pthread_mutex_t name_arena_lock     = PTHREAD_MUTEX_INITIALIZER;
+static name_arena_block_t * g_arena_blocks = NULL;
+
+/* Bytes in every block and adopted name, readable at any time */
+static _Atomic size_t g_arena_bytes = 0;
+
+/*
+ * Bumped by every reset. A thread whose block is from an older generation
+ * knows its block has been freed and starts a new one.
+ */
+static _Atomic unsigned long g_arena_generation = 1;
+
+static _Thread_local name_arena_block_t * t_arena_block = NULL;
+static _Thread_local unsigned long t_arena_generation   = 0;
+
+/* Lets go of a thread's block when the thread exits */
+static pthread_once_t name_arena_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t name_arena_key;
+
+/* Adopted names that haven't been disowned yet */
+static _Atomic size_t g_adopted_names = 0;
+
+/**
+ * @brief Add to the bytes the arena holds.
+ *
+ * @param bytes     Bytes added.
+ */
+static void count_arena_bytes(size_t bytes) {
+    atomic_fetch_add_explicit(&g_arena_bytes, bytes, memory_order_relaxed);
+}
+
+/**
+ * @brief Check if this thread's block is still in the arena.
+ *
+ * Reset is never concurrent with the thread's own allocations, so a relaxed
+ * load is enough to see that it happened.
+ *
+ * @return true     This thread has a block, and it hasn't been freed.
+ * @return false    Start a new block.
+ */
+static bool own_arena_block(void) {
+    return NULL != t_arena_block &&
+           t_arena_generation == atomic_load_explicit(&g_arena_generation, memory_order_relaxed);
+}
+
+/**
+ * @brief Let go of an exiting thread's block, so that it's freed once its
+ *        names are released rather than at the next reset.
+ *
+ * @param ptr   The thread's block.
+ */
+static void release_thread_block(void * ptr) {
+    if (ptr == t_arena_block && true == own_arena_block()) {
+        name_arena_release(t_arena_block);
+    }
+    t_arena_block = NULL;
+}
+
+/**
+ * @brief Create the key whose destructor lets go of a thread's block.
+ */
+static void create_name_arena_key(void) {
+    (void)pthread_key_create(&name_arena_key, release_thread_block);
+}
+
+/**
+ * @brief Allocate memory for a name.
+ *
+ * The memory lives until it's released with name_arena_release(), or until
+ * name_arena_reset().
+ *
+ * @param size          Number of bytes needed.
+ * @param[out] block    The block the name is in, to release it with.
+ * @return char*        The memory.
+ * @return NULL         Out of memory.
+ */
+char * name_arena_alloc(size_t size, name_arena_block_t ** block) {
+    char * name = NULL;
+    name_arena_block_t * new_block;
+    size_t block_size = NAME_ARENA_BLOCK_SZ;
+
+    if (true == own_arena_block() &&
+        t_arena_block->size - t_arena_block->used >= size) {
+        /* Fast path, there's room in this thread's block. */
+        name = &t_arena_block->data[t_arena_block->used];
+        t_arena_block->used += size;
+        atomic_fetch_add_explicit(&t_arena_block->num_names, 1, memory_order_relaxed);
+        *block = t_arena_block;
+        goto done;
+    }
+
+    if (size > block_size) {
+        /* Too big to share a block, give it a block of its own. */
+        block_size = size;
+    }
+
+    new_block = malloc(sizeof(name_arena_block_t) + block_size);
+    if (NULL == new_block) {
+        /* Out of memory! */
+        goto done;
+    }
+    new_block->size = block_size;
+    new_block->used = size;
+    new_block->prev = NULL;
+    atomic_init(&new_block->num_names, block_size == NAME_ARENA_BLOCK_SZ ? 2 : 1);
+    name        = new_block->data;
+    *block      = new_block;
+
+    /* Add the block to the list so that reset can free it. */
+    pthread_mutex_lock(&name_arena_lock);
+    new_block->next = g_arena_blocks;
+    if (NULL != g_arena_blocks) {
+        g_arena_blocks->prev = new_block;
+    }
+    g_arena_blocks = new_block;
+    count_arena_bytes(sizeof(name_arena_block_t) + block_size);
+    pthread_mutex_unlock(&name_arena_lock);
+
+    if (block_size == NAME_ARENA_BLOCK_SZ) {
+        if (true == own_arena_block()) {
+            /* We're done carving names out of the old block. */
+            name_arena_release(t_arena_block);
+        }
+
+        /* Carve this thread's next names out of the new block. */
+        t_arena_block      = new_block;
+        t_arena_generation = atomic_load_explicit(&g_arena_generation, memory_order_relaxed);
+
+        /* Let go of it if the thread exits. */
+        pthread_once(&name_arena_key_once, create_name_arena_key);
+        (void)pthread_setspecific(name_arena_key, new_block);
+    }
+
+done:
+    return name;
+}
+
+/**
+ * @brief Let go of a name allocated from the arena.
+ *
+ * The name's memory isn't reused, but once every name in its block has been
+ * released, the block is freed. Any thread may release a name, and it needn't
+ * be the one that allocated it.
+ *
+ * @param block     The block the name is in, from name_arena_alloc().
+ */
+void name_arena_release(name_arena_block_t * block) {
+    if (1 != atomic_fetch_sub_explicit(&block->num_names, 1, memory_order_acq_rel)) {
+        /* Other names in the block are still in use. */
+        return;
+    }
+
+    /* Take the block off the list so that reset doesn't free it again. */
+    pthread_mutex_lock(&name_arena_lock);
+    if (NULL != block->prev) {
+        block->prev->next = block->next;
+    } else {
+        g_arena_blocks = block->next;
+    }
+    if (NULL != block->next) {
+        block->next->prev = block->prev;
+    }
+    atomic_fetch_sub_explicit(&g_arena_bytes, sizeof(name_arena_block_t) + block->size, memory_order_relaxed);
+    pthread_mutex_unlock(&name_arena_lock);
+
+    free(block);
+}
+
+/**
+ * @brief Count a name that was allocated with malloc(), and adopted by an element.
+ *
+ * The element owns the name, and must free it with free(), after calling
+ * name_arena_disown().
+ *
+ * @param size      Number of bytes in the name, for name_arena_bytes().
+ */
+void name_arena_adopt(size_t size) {
+    atomic_fetch_add_explicit(&g_adopted_names, 1, memory_order_relaxed);
+    count_arena_bytes(size);
+}
+
+/**
+ * @brief Stop counting an adopted name, since it's about to be freed.
+ *
+ * @param size      Number of bytes in the name, as given to name_arena_adopt().
+ */
+void name_arena_disown(size_t size) {
+    atomic_fetch_sub_explicit(&g_adopted_names, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&g_arena_bytes, size, memory_order_relaxed);
+}
+
+/**
+ * @brief Count the adopted names that haven't been disowned yet.
+ *
+ * @return size_t   Number of adopted names.
+ */
+size_t name_arena_num_adopted(void) {
+    return atomic_load_explicit(&g_adopted_names, memory_order_relaxed);
+}
+
+/**
+ * @brief Free every name allocated from the arena.
+ *
+ * Names that haven't been released are freed too. Adopted names aren't, since
+ * their elements own them, and they stay counted until they're disowned. No other thread may
+ * be allocating, releasing or adopting names at the same time, or exiting
+ * after allocating some.
+ */
+void name_arena_reset(void) {
+    name_arena_block_t * block;
+
+    pthread_mutex_lock(&name_arena_lock);
+
+    while (NULL != g_arena_blocks) {
+        block          = g_arena_blocks;
+        g_arena_blocks = block->next;
+        atomic_fetch_sub_explicit(&g_arena_bytes, sizeof(name_arena_block_t) + block->size, memory_order_relaxed);
+        free(block);
+    }
+    /* Threads that allocate after the reset see that their blocks are gone. */
+    atomic_store_explicit(&g_arena_generation,
+                          atomic_load_explicit(&g_arena_generation, memory_order_relaxed) + 1,
+                          memory_order_release);
+
+    pthread_mutex_unlock(&name_arena_lock);
+}
+
+/**
+ * @brief Find how much memory the arena holds.
+ *
+ * Takes no lock, so it may miss a block that's being added.
+ *
+ * @return size_t   Bytes in every block, used or not, and in every adopted name.
+ */
+size_t name_arena_bytes(void) {
+    return atomic_load_explicit(&g_arena_bytes, memory_order_relaxed);
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Bump allocator for element names.
+ */
+
+#ifndef NAME_ARENA_H
+#define NAME_ARENA_H
+
+#include <stdbool.h>    /* For bool */
+#include <stddef.h>     /* For size_t */
+
+/* Names are carved out of blocks of this size (bigger names get their own block) */
+#define NAME_ARENA_BLOCK_SZ (64 * 1024)
+
+typedef struct name_arena_block name_arena_block_t;
+
+char * name_arena_alloc(size_t size, name_arena_block_t ** block);
+void name_arena_release(name_arena_block_t * block);
+void name_arena_adopt(size_t size);
+void name_arena_disown(size_t size);
+size_t name_arena_num_adopted(void);
+void name_arena_reset(void);
+size_t name_arena_bytes(void);
+
+#endif /* NAME_ARENA_H */
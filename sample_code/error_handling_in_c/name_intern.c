@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Intern table for element names.
+ *
+ * Each distinct name is stored once, with a count of the elements using it.
+ * Elements with the same name share the same copy, so two interned names are
+ * equal if and only if they are the same pointer.
+ *
+ * The table is a chained hash table, split into NAME_INTERN_NUM_SHARDS shards
+ * by the bottom bits of the name's hash. Each shard has its own lock and its
+ * own buckets, which use the bits above those. Names can be interned without
+ * holding any of the data array's shard locks, and threads interning
+ * different names mostly take different intern locks.
+ */
+
+/* Standard headers */
+#include <stdatomic.h>  /* For atomic_load_explicit/atomic_store_explicit */
+#include <stdbool.h>    /* For bool */
+#include <stddef.h>     /* For offsetof */
+#include <stdint.h>     /* For uint32_t */
+#include <stdlib.h>     /* For malloc/calloc/free */
+#include <string.h>     /* For memcmp/memcpy */
+
+/* 3rd-party headers */
+#include <pthread.h>
+
+/* Our headers */
+#include "data_index.h"
+#include "data_lock.h"
+#include "name_intern.h"
+
+typedef struct interned_name {
+    struct interned_name * next;    /* Next entry in the same bucket */
+    size_t   refcount;
+    size_t   name_len;
+    uint32_t hash;
+    char     name[];
+} interned_name_t;
+
+_Static_assert(0 == (NAME_INTERN_NUM_SHARDS & (NAME_INTERN_NUM_SHARDS - 1)),
+               "NAME_INTERN_NUM_SHARDS must be a power of 2");
+
+/* Shards are cache line aligned, so locking one doesn't slow down its neighbours */
+typedef struct {
+    _Alignas(DATA_SHARD_ALIGN) data_lock_t lock;  /* See data_lock.h */
+    interned_name_t ** table;
+    size_t table_size;              /* Number of buckets, a power of 2 */
+    size_t num_names;
+} intern_shard_t;
+
+static pthread_once_t g_intern_shards_once = PTHREAD_ONCE_INIT;
+static intern_shard_t g_intern_shards[NAME_INTERN_NUM_SHARDS];
+
+/* Bytes in the tables and their entries, changed under the shard locks but readable at any time */
+static _Atomic size_t g_interned_bytes = 0;
+
+/**
+ * @brief Initialize the shard locks. Use init_intern_shards() to call this.
+ */
+static void init_intern_shard_locks(void) {
+    size_t i;
+
+    for (i = 0; i < NAME_INTERN_NUM_SHARDS; i++) {
+        data_lock_init(&g_intern_shards[i].lock);
+    }
+}
+
+/**
+ * @brief Initialize the shard locks, the first time through.
+ */
+static void init_intern_shards(void) {
+    pthread_once(&g_intern_shards_once, init_intern_shard_locks);
+}
+
+/**
+ * @brief Get the shard that holds a name.
+ *
+ * @param hash              data_name_hash() of the name.
+ * @return intern_shard_t*  The shard.
+ */
+static intern_shard_t * intern_shard(uint32_t hash) {
+    return &g_intern_shards[hash & (NAME_INTERN_NUM_SHARDS - 1)];
+}
+
+/**
+ * @brief Get the bucket a name goes in within its shard.
+ *
+ * Skips the bits that picked the shard, which are the same for every name in it.
+ *
+ * @param shard             The shard.
+ * @param hash              data_name_hash() of the name.
+ * @return interned_name_t**    Head of the bucket's chain.
+ */
+static interned_name_t ** intern_bucket(const intern_shard_t * shard, uint32_t hash) {
+    return &shard->table[(hash / NAME_INTERN_NUM_SHARDS) & (shard->table_size - 1)];
+}
+
+/**
+ * @brief Add to or take away from the bytes the table holds.
+ *
+ * Shards are locked separately, so this adds atomically.
+ *
+ * @param bytes     Bytes allocated, or freed if they wrap around.
+ */
+static void count_interned_bytes(size_t bytes) {
+    atomic_fetch_add_explicit(&g_interned_bytes, bytes, memory_order_relaxed);
+}
+
+/**
+ * @brief Double the number of buckets in a shard of the intern table.
+ *
+ * The caller must hold the shard's lock.
+ *
+ * @param shard     The shard.
+ * @return true     Table resized.
+ * @return false    Out of memory.
+ */
+static bool grow_intern_table(intern_shard_t * shard) {
+    bool status = false;
+    intern_shard_t new_shard;
+    size_t i;
+
+    new_shard.table_size = shard->table_size ? shard->table_size * 2 : NAME_INTERN_MIN_SIZE;
+    new_shard.table      = calloc(new_shard.table_size, sizeof(interned_name_t *));
+    if (NULL == new_shard.table) {
+        /* Out of memory! */
+        goto done;
+    }
+
+    for (i = 0; i < shard->table_size; i++) {
+        while (NULL != shard->table[i]) {
+            interned_name_t * entry = shard->table[i];
+            interned_name_t ** bucket = intern_bucket(&new_shard, entry->hash);
+
+            shard->table[i] = entry->next;
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+
+    free(shard->table);
+    count_interned_bytes((new_shard.table_size - shard->table_size) * sizeof(interned_name_t *));
+    shard->table      = new_shard.table;
+    shard->table_size = new_shard.table_size;
+
+    status = true;
+
+done:
+    return status;
+}
+
+/**
+ * @brief Get the shared copy of a name, adding it to the table if it's new.
+ *
+ * Every successful call must be balanced by a call to release_interned_name().
+ *
+ * @param name          Name to intern. Need not be NULL-terminated.
+ * @param name_len      Length of the name.
+ * @param hash          data_name_hash() of the name, which the caller needs anyway.
+ * @return const char*  NULL-terminated shared copy of the name.
+ * @return NULL         Out of memory.
+ */
+const char * intern_name(const char * name, size_t name_len, uint32_t hash) {
+    const char * interned = NULL;
+    interned_name_t * entry;
+    interned_name_t ** bucket;
+    intern_shard_t * shard = intern_shard(hash);
+
+    init_intern_shards();
+
+    /* Lock the shard so nobody else adds or frees a name in it while we look. */
+    data_lock_acquire(&shard->lock);
+
+    if (0 != shard->table_size) {
+        for (entry = *intern_bucket(shard, hash);
+             NULL != entry;
+             entry = entry->next) {
+            if (hash == entry->hash &&
+                name_len == entry->name_len &&
+                0 == memcmp(entry->name, name, name_len)) {
+                /* Seen it before, share the existing copy. */
+                entry->refcount += 1;
+                interned = entry->name;
+                goto unlock;
+            }
+        }
+    }
+
+    if (shard->num_names >= shard->table_size) {
+        /* Keep the chains short. */
+        if (false == grow_intern_table(shard)) {
+            goto unlock;
+        }
+    }
+
+    entry = malloc(sizeof(interned_name_t) + name_len + 1);
+    if (NULL == entry) {
+        /* Out of memory! */
+        goto unlock;
+    }
+    count_interned_bytes(sizeof(interned_name_t) + name_len + 1);
+    entry->refcount = 1;
+    entry->name_len = name_len;
+    entry->hash     = hash;
+    memcpy(entry->name, name, name_len);
+    entry->name[name_len] = '\0';
+
+    bucket      = intern_bucket(shard, hash);
+    entry->next = *bucket;
+    *bucket     = entry;
+    shard->num_names += 1;
+
+    interned = entry->name;
+
+unlock:
+    /* Unlock the shard so other threads can access it once more. */
+    data_lock_release(&shard->lock);
+
+    return interned;
+}
+
+/**
+ * @brief Drop a reference to an interned name, freeing it if it was the last.
+ *
+ * @param name  Name returned by intern_name().
+ */
+void release_interned_name(const char * name) {
+    interned_name_t * entry;
+    interned_name_t ** link;
+    intern_shard_t * shard;
+
+    entry = (interned_name_t *)(name - offsetof(interned_name_t, name));
+    shard = intern_shard(entry->hash);
+
+    /* Lock the shard so nobody else shares the name while we let go of it. */
+    data_lock_acquire(&shard->lock);
+
+    entry->refcount -= 1;
+    if (0 == entry->refcount) {
+        /* Last one out, unlink it from its bucket and free it. */
+        link = intern_bucket(shard, entry->hash);
+        while (*link != entry) {
+            link = &(*link)->next;
+        }
+        *link = entry->next;
+        shard->num_names -= 1;
+        count_interned_bytes(0 - (sizeof(interned_name_t) + entry->name_len + 1));
+        free(entry);
+    }
+
+    /* Unlock the shard so other threads can access it once more. */
+    data_lock_release(&shard->lock);
+}
+
+/**
+ * @brief Free every interned name, whatever its reference count.
+ *
+ * Used when the data array is freed, so that it needn't release its element
+ * names one at a time.
+ */
+void clear_interned_names(void) {
+    size_t s;
+    size_t i;
+
+    init_intern_shards();
+
+    for (s = 0; s < NAME_INTERN_NUM_SHARDS; s++) {
+        intern_shard_t * shard = &g_intern_shards[s];
+
+        /* Lock the shard so nobody else adds a name to it while we free them. */
+        data_lock_acquire(&shard->lock);
+
+        for (i = 0; i < shard->table_size; i++) {
+            while (NULL != shard->table[i]) {
+                interned_name_t * entry = shard->table[i];
+
+                shard->table[i] = entry->next;
+                count_interned_bytes(0 - (sizeof(interned_name_t) + entry->name_len + 1));
+                free(entry);
+            }
+        }
+        count_interned_bytes(0 - shard->table_size * sizeof(interned_name_t *));
+        free(shard->table);
+        shard->table      = NULL;
+        shard->table_size = 0;
+        shard->num_names  = 0;
+
+        /* Unlock the shard so other threads can access it once more. */
+        data_lock_release(&shard->lock);
+    }
+}
+
+/**
+ * @brief Find how much memory the intern table holds.
+ *
+ * Takes no lock, so it may be a name or two out of date.
+ *
+ * @return size_t   Bytes in the table and every name in it.
+ */
+size_t interned_names_bytes(void) {
+    return atomic_load_explicit(&g_interned_bytes, memory_order_relaxed);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2020 Micah Snyder
+ *
+ * Intern table for element names.
+ */
+
+#ifndef NAME_INTERN_H
+#define NAME_INTERN_H
+
+#include <stddef.h>     /* For size_t */
+#include <stdint.h>     /* For uint32_t */
+
+/* Each shard's table is resized to keep its load factor at or below 1 */
+#define NAME_INTERN_MIN_SIZE 256
+
+/*
+ * The table is split into shards by name hash, each with its own lock and
+ * buckets, so threads interning different names rarely wait on each other.
+ * Must be a power of 2.
+ */
+#ifndef NAME_INTERN_NUM_SHARDS
+#define NAME_INTERN_NUM_SHARDS 16
+#endif
+
+const char * intern_name(const char * name, size_t name_len, uint32_t hash);
+void release_interned_name(const char * name);
+void clear_interned_names(void);
+size_t interned_names_bytes(void);
+
+#endif /* NAME_INTERN_H */
@@ -5,6 +5,7 @@
  */
 
 /* Standard headers */
+#include <stdatomic.h>  /* For atomic_bool */
 #include <stdbool.h>    /* For bool */
 #include <stdlib.h>     /* For malloc/free */
 #include <string.h>     /* For strdup */
@@ -15,55 +16,847 @@
 
 /* Our headers */
 #include "sample_test.h"
+#include "data_buffer.h"
+#include "data_freeze.h"
+#include "data_index.h"
+#include "data_load.h"
+#include "data_rcu.h"
+#include "name_arena.h"
+#include "name_intern.h"
 
-pthread_mutex_t data_array_lock = PTHREAD_MUTEX_INITIALIZER;
-named_data_t ** g_data_array    = NULL;
-size_t g_data_array_size        = 0;
-size_t g_num_data_elements      = 0;
+/**
+ * @brief Count the elements visited by a scan.
+ *
+ * @param element   The element.
+ * @param ctx       Pointer to the count.
+ * @return true     Keep scanning.
+ */
+static bool count_element(named_data_t * element, void * ctx) {
+    (void)element;
+    *(size_t *)ctx += 1;
+    return true;
+}
+
+/**
+ * @brief Remember the last element visited by a scan.
+ *
+ * @param element   The element.
+ * @param ctx       Pointer to where to put the element.
+ * @return true     Keep scanning.
+ */
+static bool find_element(named_data_t * element, void * ctx) {
+    *(named_data_t **)ctx = element;
+    return true;
+}
+
+/**
+ * @brief Count the elements in each chunk visited by for_each_data_element().
+ *
+ * @param elements      The elements in the chunk.
+ * @param num_elements  Number of elements in the chunk.
+ * @param ctx           Pointer to the count.
+ * @return true         Keep scanning.
+ * @return false        Stop the scan, since the chunk is bad.
+ */
+static bool count_chunk(named_data_t * const * elements, size_t num_elements, void * ctx) {
+    size_t i;
+
+    if (0 == num_elements || num_elements > DATA_SCAN_CHUNK_SZ) {
+        return false;
+    }
+    for (i = 0; i < num_elements; i++) {
+        if (elements[i]->name_len != strlen(data_element_name(elements[i]))) {
+            return false;
+        }
+    }
+
+    *(size_t *)ctx += num_elements;
+    return true;
+}
+
+/**
+ * @brief Copy the elements of each chunk visited by for_each_data_element().
+ *
+ * @param elements      The elements in the chunk.
+ * @param num_elements  Number of elements in the chunk.
+ * @param ctx           Pointer to where to put the next element, moved past the chunk.
+ * @return true         Keep scanning.
+ */
+static bool collect_chunk(named_data_t * const * elements, size_t num_elements, void * ctx) {
+    named_data_t *** next_element = ctx;
+
+    memcpy(*next_element, elements, num_elements * sizeof(named_data_t *));
+    *next_element += num_elements;
+    return true;
+}
+
+/**
+ * @brief Count the elements in the array by visiting every one, shard by shard.
+ *
+ * @return size_t   Number of elements visited that are in the right shard,
+ *                  not counting removed ones.
+ */
+static size_t count_all_elements(void) {
+    size_t count = 0;
+    size_t shard;
+    size_t i;
+
+    for (shard = 0; shard < DATA_ARRAY_NUM_SHARDS; shard++) {
+        for (i = 0; i < g_data_shards[shard].num_elements; i++) {
+            named_data_t * element = data_shard_element(&g_data_shards[shard], i);
+
+            if (false == data_shard_removed(&g_data_shards[shard], i) &&
+                &g_data_shards[shard] == data_array_shard(element->name_hash)) {
+                count += 1;
+            }
+        }
+    }
+
+    return count;
+}
+
+/* Enough elements to make the array grow a couple of times */
+#define NUM_TEST_ELEMENTS (ARRAY_BLK_SZ * 4)
+
+/* A name too long to store inside the element */
+#define LONG_TEST_NAME "This name is much too long to store inline"
+
+/* Enough long names to fill several blocks of the name arena */
+#define NUM_CHURN_ELEMENTS (NAME_ARENA_BLOCK_SZ / 4)
+
+/* Number of threads to append from at once */
+#define NUM_TEST_THREADS 4
+
+/* Enough to give every loader thread a few batches, and a partial one at the end */
+#define NUM_LOAD_ELEMENTS (DATA_LOAD_BATCH_SZ * 2 * NUM_TEST_THREADS + 1)
+
+typedef struct {
+    pthread_t thread;
+    size_t    number;
+    bool      status;
+} test_thread_t;
 
 /**
- * @brief Clean up the global data array.
+ * @brief Thread that appends NUM_TEST_ELEMENTS elements of its own.
+ *
+ * @param arg       The test_thread_t for this thread.
+ * @return void*    NULL. Success or failure is recorded in the test_thread_t.
  */
-void free_data_array() {
-    size_t i = 0;
+static void * append_thread(void * arg) {
+    test_thread_t * test_thread = arg;
+    char name[32];
+    size_t i;
 
-    /* Lock the array so we can safely add our new element. */
-    pthread_mutex_lock(&data_array_lock);
+    for (i = 0; i < NUM_TEST_ELEMENTS; i++) {
+        snprintf(name, sizeof(name), "thread-%zu-%zu", test_thread->number, i);
+        if (false == append_data_element(name, (void *)"World")) {
+            return NULL;
+        }
+    }
 
-    if (NULL == g_data_array) {
-        /* Nothing to clean up */
-        goto unlock;
+    test_thread->status = true;
+    return NULL;
+}
+
+/**
+ * @brief Thread that buffers NUM_TEST_ELEMENTS elements, and exits without flushing.
+ *
+ * @param arg       The test_thread_t for this thread.
+ * @return void*    NULL. Success or failure is recorded in the test_thread_t.
+ */
+static void * buffer_thread(void * arg) {
+    test_thread_t * test_thread = arg;
+    char name[32];
+    size_t i;
+
+    for (i = 0; i < NUM_TEST_ELEMENTS; i++) {
+        snprintf(name, sizeof(name), "buffered-%zu-%zu", test_thread->number, i);
+        if (false == buffer_data_element(name, (void *)"World")) {
+            return NULL;
+        }
     }
-    for (i = 0; i < g_num_data_elements; i++) {
-        /*
-         * Free each data element.
-         * NULL checks not required because the num elements
-         * integer indicates that the element was allocated.
-         */
-        free(g_data_array[i]->name);
-        free(g_data_array[i]);
+
+    test_thread->status = true;
+    return NULL;
+}
+
+/**
+ * @brief Thread that removes the elements its append_thread() added, while
+ *        looking up the ones another thread is removing.
+ *
+ * @param arg       The test_thread_t for this thread.
+ * @return void*    NULL. Success or failure is recorded in the test_thread_t.
+ */
+static void * remove_thread(void * arg) {
+    test_thread_t * test_thread = arg;
+    char name[32];
+    size_t i;
+
+    for (i = 0; i < NUM_TEST_ELEMENTS; i++) {
+        named_data_t * element;
+
+        snprintf(name, sizeof(name), "thread-%zu-%zu", test_thread->number, i);
+        if (false == remove_data_element(name)) {
+            return NULL;
+        }
+
+        /* The element can't be freed while we're reading it. */
+        snprintf(name, sizeof(name), "thread-%zu-%zu", (test_thread->number + 1) % NUM_TEST_THREADS, i);
+        data_rcu_read_lock();
+        element = lookup_data_element(name);
+        if (NULL != element && 0 != strcmp(data_element_name(element), name)) {
+            data_rcu_read_unlock();
+            return NULL;
+        }
+        data_rcu_read_unlock();
     }
-    free(g_data_array);
-    g_data_array = NULL;
 
-unlock:
-    /* Unlock the array so other threads can access it once more. */
-    pthread_mutex_unlock(&data_array_lock);
+    test_thread->status = true;
+    return NULL;
+}
+
+/* Set while the append threads are running */
+static atomic_bool g_appending = false;
 
-    return;
+/**
+ * @brief Thread that looks elements up while other threads append them.
+ *
+ * Checks that the array only ever grows, and that an element stays findable
+ * once it has been found.
+ *
+ * @param arg       The test_thread_t for this thread.
+ * @return void*    NULL. Success or failure is recorded in the test_thread_t.
+ */
+static void * lookup_thread(void * arg) {
+    test_thread_t * test_thread = arg;
+    size_t last_count = 0;
+    bool found = false;
+
+    do {
+        size_t count = count_all_elements();
+        size_t num_found = 0;
+        data_array_stats_t stats;
+
+        if (count < last_count || count > NUM_TEST_THREADS * NUM_TEST_ELEMENTS) {
+            return NULL;
+        }
+        last_count = count;
+
+        /* Statistics can be read while others append, without the locks. */
+        get_data_array_stats(&stats);
+        if (stats.count > NUM_TEST_THREADS * NUM_TEST_ELEMENTS) {
+            return NULL;
+        }
+
+        if (NULL != lookup_data_element("thread-0-0")) {
+            found = true;
+        } else if (true == found) {
+            return NULL;
+        }
+
+        if (1 < scan_data_elements_by_name("thread-1-0", count_element, &num_found)) {
+            return NULL;
+        }
+
+        num_found = 0;
+        if (for_each_data_element(count_chunk, &num_found) != num_found ||
+            num_found > NUM_TEST_THREADS * NUM_TEST_ELEMENTS) {
+            return NULL;
+        }
+    } while (atomic_load(&g_appending));
+
+    test_thread->status = true;
+    return NULL;
 }
 
 int main(void) {
     int status = 1;
+    size_t i;
+    char name[32];
+    named_data_t * first_element;
+    named_data_t * second_element = NULL;
+    named_data_t * last_element;
+    named_data_t * middle_element;
+    named_data_t * long_element;
+    named_data_t * short_slice;
+    named_data_t * long_slice;
+    test_thread_t threads[NUM_TEST_THREADS];
+    test_thread_t reader = {0};
+    data_lock_stats_t lock_stats;
+    data_array_stats_t stats;
+    data_teardown_options_t teardown_options = {0};
+    size_t num_elements;
+    size_t reserved_size;
+    size_t names_bytes;
+    size_t num_found;
+    char * load_names = NULL;
+    const char ** load_name_ptrs = NULL;
+    bool * load_added = NULL;
+    named_data_t ** skipped_elements = NULL;
+    named_data_t ** next_skipped;
+    uint64_t acquisitions;
+    data_handle_t handle;
+    data_handle_t kept_handle;
 
-    if (false == append_data_element("Hello", (void *)"World")) {
+    if (false == append_data_element("Hello", (void *)"World") ||
+        NULL == (first_element = lookup_data_element("Hello"))) {
         printf("Failed to add element to array\n");
         goto done;
     }
-    status = 0;
     printf("Added element to array\n");
 
+    for (i = 1; i < NUM_TEST_ELEMENTS; i++) {
+        snprintf(name, sizeof(name), "element-%zu", i);
+        if (false == append_data_element(name, (void *)"World")) {
+            printf("Failed to add element %zu to array\n", i);
+            goto done;
+        }
+    }
+    last_element = lookup_data_element(name);
+    if (NUM_TEST_ELEMENTS != data_array_count() ||
+        NUM_TEST_ELEMENTS != count_all_elements() ||
+        data_array_capacity() < NUM_TEST_ELEMENTS ||
+        NULL == last_element ||
+        0 != strcmp(data_element_name(last_element), name)) {
+        printf("Array is missing elements after growing\n");
+        goto done;
+    }
+    if (first_element != lookup_data_element("Hello") ||
+        0 != strcmp(data_element_name(first_element), "Hello")) {
+        printf("Array moved elements while growing\n");
+        goto done;
+    }
+    printf("Grew array to %zu elements\n", data_array_capacity());
+
+    get_data_array_stats(&stats);
+    if (NUM_TEST_ELEMENTS != stats.count ||
+        data_array_capacity() != stats.capacity ||
+        stats.bytes_used < stats.capacity * DATA_SLOT_BYTES ||
+        stats.num_growths < 2) {
+        printf("Array statistics are wrong\n");
+        goto done;
+    }
+
+    /* Visit every element, a chunk at a time. */
+    num_found = 0;
+    if (NUM_TEST_ELEMENTS != for_each_data_element(count_chunk, &num_found) ||
+        NUM_TEST_ELEMENTS != num_found) {
+        printf("Failed to visit every element in chunks\n");
+        goto done;
+    }
+
+    /* Look elements up by name. */
+    if (NULL != lookup_data_element("Goodbye")) {
+        printf("Lookup by name found the wrong element\n");
+        goto done;
+    }
+    if (false == append_data_element("Hello", (void *)"Again") ||
+        first_element != lookup_data_element("Hello")) {
+        printf("Lookup by name didn't find the first of two elements with the same name\n");
+        goto done;
+    }
+    num_found = 0;
+    if (2 != scan_data_elements_by_name("Hello", count_element, &num_found) || 2 != num_found ||
+        0 != scan_data_elements_by_name("Goodbye", count_element, &num_found) ||
+        2 != scan_data_elements_by_name("Hello", find_element, &second_element) ||
+        first_element == second_element) {
+        printf("Scan by name found the wrong number of elements\n");
+        goto done;
+    }
+    if (false == data_element_names_equal(first_element, second_element) ||
+        true == data_element_names_equal(first_element, last_element)) {
+        printf("Name comparison got the wrong answer\n");
+        goto done;
+    }
+    if (DATA_NAMES_INTERNED &&
+        data_element_name(first_element) != data_element_name(second_element)) {
+        printf("Elements with the same name don't share an interned copy\n");
+        goto done;
+    }
+    printf("Looked up elements by name\n");
+
+    /* Names too long to store inline go on the heap, but look the same. */
+    if (false == append_data_element(LONG_TEST_NAME, (void *)"World") ||
+        NULL == (long_element = lookup_data_element(LONG_TEST_NAME)) ||
+        0 != strcmp(data_element_name(long_element), LONG_TEST_NAME)) {
+        printf("Failed to add element with a long name\n");
+        goto done;
+    }
+    printf("Added element with a long name\n");
+
+    /* Names can be slices of a bigger buffer, short or long. */
+    if (false == append_data_element_n(LONG_TEST_NAME, 4, (void *)"Short slice") ||
+        false == append_data_element_n(LONG_TEST_NAME, 26, (void *)"Long slice") ||
+        NULL == (short_slice = lookup_data_element("This")) ||
+        NULL == (long_slice = lookup_data_element("This name is much too long")) ||
+        0 != strcmp(short_slice->data, "Short slice") ||
+        0 != strcmp(long_slice->data, "Long slice") ||
+        4 != short_slice->name_len ||
+        0 != strcmp(data_element_name(short_slice), "This") ||
+        0 != strcmp(data_element_name(long_slice), "This name is much too long")) {
+        printf("Failed to add elements named by slices\n");
+        goto done;
+    }
+    printf("Added elements named by slices\n");
+
+    /* Names can be handed over rather than copied. The array frees them, even once they're removed. */
+    if (false == append_data_element_owned(strdup("Owned"), (void *)"Short owned") ||
+        false == append_data_element_owned(strdup(LONG_TEST_NAME " and owned"), (void *)"Long owned") ||
+        true == append_data_element_owned(strdup("Owned without data"), NULL) ||
+        false == append_data_element_owned(strdup(LONG_TEST_NAME " and removed"), (void *)"Removed") ||
+        false == remove_data_element(LONG_TEST_NAME " and removed") ||
+        NULL == (short_slice = lookup_data_element("Owned")) ||
+        NULL == (long_slice = lookup_data_element(LONG_TEST_NAME " and owned")) ||
+        0 != strcmp(short_slice->data, "Short owned") ||
+        0 != strcmp(long_slice->data, "Long owned") ||
+        NULL != lookup_data_element("Owned without data")) {
+        printf("Failed to add elements with owned names\n");
+        goto done;
+    }
+    printf("Added elements with owned names\n");
+
+    /* Handles find elements again without looking them up, until they're removed. */
+    if (false == append_data_element_handle("Handled", 7, (void *)"By handle", &handle) ||
+        false == append_data_element_handle("Handled too", 11, (void *)"By handle", &kept_handle) ||
+        NULL == (short_slice = get_data_element(handle)) ||
+        short_slice != lookup_data_element("Handled") ||
+        get_data_element(kept_handle) != lookup_data_element("Handled too") ||
+        NULL != get_data_element(DATA_HANDLE_INVALID) ||
+        NULL != get_data_element(kept_handle + 1)) {
+        printf("Failed to get elements by handle\n");
+        goto done;
+    }
+    if (false == remove_data_element("Handled") ||
+        NULL != get_data_element(handle) ||
+        NULL == get_data_element(kept_handle)) {
+        printf("Handle to a removed element isn't stale\n");
+        goto done;
+    }
+    printf("Got elements by handle\n");
+
+    /* Freeze the array, and look elements up in the snapshot. */
+    snprintf(name, sizeof(name), "element-%zu", (size_t)NUM_TEST_ELEMENTS / 2);
+    middle_element = lookup_data_element(name);
+    if (false == freeze_data_array()) {
+        printf("Failed to freeze array\n");
+        goto done;
+    }
+    if (first_element != lookup_data_element("Hello") ||
+        NULL == middle_element ||
+        middle_element != lookup_data_element(name) ||
+        long_element != lookup_data_element(LONG_TEST_NAME) ||
+        NULL != lookup_data_element("Goodbye") ||
+        NULL != lookup_data_element("") ||
+        NULL != lookup_data_element("~~~")) {
+        printf("Lookup in frozen array found the wrong element\n");
+        goto done;
+    }
+    if (true == append_data_element("Frozen", (void *)"World") ||
+        0 != compact_data_array(DATA_COMPACT_ANY_ORDER)) {
+        printf("Changed frozen array\n");
+        goto done;
+    }
+    unfreeze_data_array();
+    if (false == append_data_element("Thawed", (void *)"World") ||
+        NULL == lookup_data_element("Thawed")) {
+        printf("Failed to add element to unfrozen array\n");
+        goto done;
+    }
+    printf("Froze and unfroze array\n");
+
+    /* Remove elements, and make sure lookups and scans don't find them. */
+    num_elements = data_array_count();
+    if (false == remove_data_element("Hello") ||
+        second_element != lookup_data_element("Hello") ||
+        num_elements - 1 != data_array_count() ||
+        num_elements - 1 != count_all_elements()) {
+        printf("Failed to remove the first of two elements with the same name\n");
+        goto done;
+    }
+    num_found = 0;
+    if (false == remove_data_element("Hello") ||
+        NULL != lookup_data_element("Hello") ||
+        0 != scan_data_elements_by_name("Hello", count_element, &num_found) ||
+        true == remove_data_element("Hello") ||
+        num_elements - 2 != data_array_count() ||
+        num_elements - 2 != for_each_data_element(count_chunk, &num_found)) {
+        printf("Failed to remove the last element with a name\n");
+        goto done;
+    }
+    if (false == append_data_element("Hello", (void *)"Once more") ||
+        NULL == (first_element = lookup_data_element("Hello")) ||
+        0 != strcmp(first_element->data, "Once more")) {
+        printf("Failed to add an element with the name of a removed one\n");
+        goto done;
+    }
+    if (false == freeze_data_array() ||
+        true == remove_data_element("Hello") ||
+        first_element != lookup_data_element("Hello")) {
+        printf("Removed element from frozen array\n");
+        goto done;
+    }
+    unfreeze_data_array();
+    printf("Removed elements\n");
+
+    /* Remove elements by handle, even once their name is indexed with others. */
+    if (false == append_data_element_handle("Churned", 7, (void *)"First", &handle) ||
+        false == append_data_element_handle("Churned", 7, (void *)"Second", &kept_handle)) {
+        printf("Failed to add elements to remove by handle\n");
+        goto done;
+    }
+    for (i = 0; i <= DATA_INDEX_MAX_LAG; i++) {
+        snprintf(name, sizeof(name), "churn-%zu", i);
+        if (false == append_data_element(name, (void *)"World")) {
+            printf("Failed to add element %zu to churn\n", i);
+            goto done;
+        }
+    }
+    if (get_data_element(handle) != lookup_data_element("Churned") ||
+        false == remove_data_element_by_handle(handle) ||
+        true == remove_data_element_by_handle(handle) ||
+        NULL != get_data_element(handle) ||
+        NULL == (first_element = lookup_data_element("Churned")) ||
+        first_element != get_data_element(kept_handle)) {
+        printf("Failed to remove element by handle\n");
+        goto done;
+    }
+    printf("Removed element by handle\n");
+
+    /* Compacting from inside a read section would wait for itself, so it's refused. */
+    data_rcu_read_lock();
+    num_found = compact_data_array(DATA_COMPACT_KEEP_ORDER);
+    data_rcu_read_unlock();
+    if (0 != num_found) {
+        printf("Compacted array from inside a read section\n");
+        goto done;
+    }
+
+    /* Compact the array to reclaim the removed slots, in order and then in any order. Handles follow the elements. */
+    num_elements = data_array_count();
+    get_data_array_stats(&stats);
+    if (0 == stats.num_removed ||
+        num_elements + stats.num_removed != data_array_used_slots() ||
+        stats.num_removed != compact_data_array(DATA_COMPACT_KEEP_ORDER) ||
+        0 != compact_data_array(DATA_COMPACT_KEEP_ORDER) ||
+        num_elements != data_array_count() ||
+        num_elements != data_array_used_slots() ||
+        num_elements != count_all_elements() ||
+        NULL != get_data_element(handle) ||
+        NULL == (first_element = lookup_data_element("Churned")) ||
+        first_element != get_data_element(kept_handle) ||
+        0 != strcmp(first_element->data, "Second") ||
+        NULL == lookup_data_element("churn-0")) {
+        printf("Failed to compact array in order\n");
+        goto done;
+    }
+    if (false == append_data_element_handle("Moved", 5, (void *)"World", &handle) ||
+        false == remove_data_element("churn-0") ||
+        false == remove_data_element("Churned") ||
+        2 != compact_data_array(DATA_COMPACT_ANY_ORDER) ||
+        num_elements - 1 != data_array_count() ||
+        num_elements - 1 != count_all_elements() ||
+        NULL != get_data_element(kept_handle) ||
+        NULL == get_data_element(handle) ||
+        get_data_element(handle) != lookup_data_element("Moved") ||
+        NULL != lookup_data_element("churn-0") ||
+        NULL == lookup_data_element("churn-1") ||
+        false == append_data_element("Compacted", (void *)"World") ||
+        NULL == lookup_data_element("Compacted") ||
+        num_elements != count_all_elements()) {
+        printf("Failed to compact array in any order\n");
+        goto done;
+    }
+    printf("Compacted array\n");
+
+    /* The long names of removed elements are freed, so churning them doesn't grow the arena. */
+    data_rcu_synchronize();
+    names_bytes = name_arena_bytes() + interned_names_bytes();
+    for (i = 0; i < NUM_CHURN_ELEMENTS; i++) {
+        snprintf(name, sizeof(name), "churned-with-a-long-name-%zu", i);
+        if (false == append_data_element(name, (void *)"World") ||
+            false == remove_data_element(name)) {
+            printf("Failed to churn element %zu\n", i);
+            goto done;
+        }
+    }
+    data_rcu_synchronize();
+    if (name_arena_bytes() + interned_names_bytes() > names_bytes + 2 * NAME_ARENA_BLOCK_SZ) {
+        printf("Names of removed elements weren't freed\n");
+        goto done;
+    }
+    printf("Freed names of removed elements\n");
+
+    free_data_array();
+    if (NULL != lookup_data_element("Hello") || 0 != data_array_count()) {
+        printf("Freed array still has elements in its index\n");
+        goto done;
+    }
+    if (0 != name_arena_num_adopted() || 0 != name_arena_bytes()) {
+        printf("Freed array still has names in the arena\n");
+        goto done;
+    }
+
+    /* Append from several threads at once, while another one looks them up. */
+    atomic_store(&g_appending, true);
+    if (0 != pthread_create(&reader.thread, NULL, lookup_thread, &reader)) {
+        printf("Failed to start lookup thread\n");
+        goto done;
+    }
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        threads[i].number = i;
+        threads[i].status = false;
+        if (0 != pthread_create(&threads[i].thread, NULL, append_thread, &threads[i])) {
+            printf("Failed to start thread %zu\n", i);
+            goto done;
+        }
+    }
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    atomic_store(&g_appending, false);
+    pthread_join(reader.thread, NULL);
+    if (false == reader.status) {
+        printf("Lookups saw inconsistent elements while appending\n");
+        goto done;
+    }
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        snprintf(name, sizeof(name), "thread-%zu-%zu", i, (size_t)NUM_TEST_ELEMENTS - 1);
+        if (false == threads[i].status || NULL == lookup_data_element(name)) {
+            printf("Failed to add elements from thread %zu\n", i);
+            goto done;
+        }
+    }
+    if (NUM_TEST_THREADS * NUM_TEST_ELEMENTS != data_array_count() ||
+        NUM_TEST_THREADS * NUM_TEST_ELEMENTS != count_all_elements()) {
+        printf("Array is missing elements added from threads\n");
+        goto done;
+    }
+    printf("Added elements from %d threads\n", NUM_TEST_THREADS);
+
+    /* The array has been freed and refilled since, so old handles are stale. */
+    if (NULL != get_data_element(kept_handle)) {
+        printf("Handle from before the array was freed isn't stale\n");
+        goto done;
+    }
+
+    /* Remove them from several threads at once, while looking them up. */
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        threads[i].status = false;
+        if (0 != pthread_create(&threads[i].thread, NULL, remove_thread, &threads[i])) {
+            printf("Failed to start thread %zu\n", i);
+            goto done;
+        }
+    }
+
+    /* Compact the array under them as they go. Their lookups must never see an element move. */
+    for (i = 0; i < NUM_TEST_ELEMENTS / 8; i++) {
+        (void)compact_data_array(0 == i % 2 ? DATA_COMPACT_KEEP_ORDER : DATA_COMPACT_ANY_ORDER);
+    }
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        if (false == threads[i].status) {
+            printf("Failed to remove elements from thread %zu\n", i);
+            goto done;
+        }
+    }
+    if (0 != data_array_count() || 0 != count_all_elements()) {
+        printf("Array still has elements removed from threads\n");
+        goto done;
+    }
+    printf("Removed elements from %d threads\n", NUM_TEST_THREADS);
+
+    /* Growing the array always takes the locks, even when appending doesn't. */
+    data_array_lock_stats(&lock_stats);
+    if (0 == lock_stats.acquisitions || lock_stats.contended > lock_stats.acquisitions) {
+        printf("Lock statistics are wrong\n");
+        goto done;
+    }
+
+    free_data_array();
+
+    /* Reserve room up front, then make sure appending doesn't move the array. */
+    if (false == reserve_data_array(NUM_TEST_ELEMENTS)) {
+        printf("Failed to reserve array\n");
+        goto done;
+    }
+    reserved_size = data_array_capacity();
+    if (NUM_TEST_ELEMENTS > reserved_size) {
+        printf("Reserved array is too small\n");
+        goto done;
+    }
+    for (i = 0; i < NUM_TEST_ELEMENTS; i++) {
+        snprintf(name, sizeof(name), "reserved-%zu", i);
+        if (false == append_data_element(name, (void *)"World")) {
+            printf("Failed to add element %zu to reserved array\n", i);
+            goto done;
+        }
+    }
+    if (reserved_size != data_array_capacity()) {
+        printf("Reserved array grew unexpectedly\n");
+        goto done;
+    }
+    printf("Filled reserved array without growing\n");
+
+    /*
+     * Free the elements on a few threads. Only builds with small teardown
+     * chunks (see CMakeLists.txt) have enough chunks for every thread.
+     */
+    teardown_options.num_threads = 4;
+    teardown_data_array(&teardown_options);
+    if (0 != data_array_count() || 0 != data_array_capacity() || NULL != lookup_data_element("reserved-0")) {
+        printf("Torn down array still has elements\n");
+        goto done;
+    }
+
+    /* Load a lot of elements at once, on several threads. */
+    load_names     = malloc(NUM_LOAD_ELEMENTS * sizeof(name));
+    load_name_ptrs = malloc(NUM_LOAD_ELEMENTS * sizeof(const char *));
+    if (NULL == load_names || NULL == load_name_ptrs) {
+        printf("Failed to allocate names to load\n");
+        goto done;
+    }
+    for (i = 0; i < NUM_LOAD_ELEMENTS; i++) {
+        /* Every third name is too long to store inline. */
+        snprintf(&load_names[i * sizeof(name)], sizeof(name),
+                 0 == i % 3 ? "loaded-with-a-long-name-%zu" : "loaded-%zu", i);
+        load_name_ptrs[i] = &load_names[i * sizeof(name)];
+    }
+    if (false == load_data_elements(load_name_ptrs, (void * const *)load_name_ptrs, NUM_LOAD_ELEMENTS, NUM_TEST_THREADS) ||
+        NUM_LOAD_ELEMENTS != data_array_count() ||
+        NUM_LOAD_ELEMENTS != count_all_elements()) {
+        printf("Failed to load elements\n");
+        goto done;
+    }
+    for (i = 0; i < NUM_LOAD_ELEMENTS; i++) {
+        named_data_t * element = lookup_data_element(load_name_ptrs[i]);
+
+        if (NULL == element || element->data != load_name_ptrs[i]) {
+            printf("Failed to look up loaded element %zu\n", i);
+            goto done;
+        }
+    }
+    printf("Loaded %d elements on %d threads\n", NUM_LOAD_ELEMENTS, NUM_TEST_THREADS);
+
+    /* Tear down without freeing the elements one at a time, then free them ourselves. */
+    skipped_elements = malloc(NUM_LOAD_ELEMENTS * sizeof(named_data_t *));
+    if (NULL == skipped_elements) {
+        printf("Failed to allocate skipped elements\n");
+        goto done;
+    }
+    next_skipped = skipped_elements;
+    if (NUM_LOAD_ELEMENTS != for_each_data_element(collect_chunk, &next_skipped)) {
+        printf("Failed to collect loaded elements\n");
+        goto done;
+    }
+    teardown_options.skip_element_frees = true;
+    teardown_data_array(&teardown_options);
+    if (0 != data_array_count() || NULL != lookup_data_element(load_name_ptrs[0])) {
+        printf("Torn down array still has elements\n");
+        goto done;
+    }
+    if (false == DATA_ARRAY_INLINE) {
+        /* Only elements in their own allocations were skipped. */
+        for (i = 0; i < NUM_LOAD_ELEMENTS; i++) {
+            free(skipped_elements[i]);
+        }
+    }
+    printf("Tore down array without freeing its elements\n");
+
+    /* Append the same elements as one batch, with one bad one. */
+    load_added = malloc(NUM_LOAD_ELEMENTS * sizeof(bool));
+    if (NULL == load_added) {
+        printf("Failed to allocate batch results\n");
+        goto done;
+    }
+    load_name_ptrs[1] = NULL;
+    data_array_lock_stats(&lock_stats);
+    acquisitions = lock_stats.acquisitions;
+    if (NUM_LOAD_ELEMENTS - 1 != append_data_elements(load_name_ptrs, (void * const *)load_name_ptrs,
+                                                      NUM_LOAD_ELEMENTS, load_added)) {
+        printf("Failed to append a batch of elements\n");
+        goto done;
+    }
+    data_array_lock_stats(&lock_stats);
+    if (lock_stats.acquisitions - acquisitions > DATA_ARRAY_NUM_SHARDS) {
+        printf("Appending a batch locked shards more than once\n");
+        goto done;
+    }
+    for (i = 0; i < NUM_LOAD_ELEMENTS; i++) {
+        if (load_added[i] != (1 != i) ||
+            (1 != i && NULL == lookup_data_element(load_name_ptrs[i]))) {
+            printf("Batch append misreported element %zu\n", i);
+            goto done;
+        }
+    }
+    if (NUM_LOAD_ELEMENTS - 1 != data_array_count()) {
+        printf("Array is missing batch appended elements\n");
+        goto done;
+    }
+    printf("Appended a batch of %d elements\n", NUM_LOAD_ELEMENTS);
+
+    free_data_array();
+
+    /* Buffered elements only show up once they're flushed. */
+    for (i = 0; i < DATA_BUFFER_SIZE - 1; i++) {
+        snprintf(name, sizeof(name), "buffered-%zu", i);
+        if (false == buffer_data_element(name, (void *)"World")) {
+            printf("Failed to buffer element %zu\n", i);
+            goto done;
+        }
+    }
+    if (0 != data_array_count() || NULL != lookup_data_element("buffered-0")) {
+        printf("Buffered elements were added before the buffer was flushed\n");
+        goto done;
+    }
+    if (false == flush_data_elements() ||
+        DATA_BUFFER_SIZE - 1 != data_array_count() ||
+        NULL == lookup_data_element("buffered-0")) {
+        printf("Failed to flush buffered elements\n");
+        goto done;
+    }
+
+    /* A full buffer flushes itself, and so does a thread that exits. */
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        threads[i].number = i;
+        threads[i].status = false;
+        if (0 != pthread_create(&threads[i].thread, NULL, buffer_thread, &threads[i])) {
+            printf("Failed to start thread %zu\n", i);
+            goto done;
+        }
+    }
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    for (i = 0; i < NUM_TEST_THREADS; i++) {
+        snprintf(name, sizeof(name), "buffered-%zu-%zu", i, (size_t)NUM_TEST_ELEMENTS - 1);
+        if (false == threads[i].status || NULL == lookup_data_element(name)) {
+            printf("Failed to flush elements buffered by thread %zu\n", i);
+            goto done;
+        }
+    }
+    if (DATA_BUFFER_SIZE - 1 + NUM_TEST_THREADS * NUM_TEST_ELEMENTS != data_array_count() ||
+        DATA_BUFFER_SIZE - 1 + NUM_TEST_THREADS * NUM_TEST_ELEMENTS != count_all_elements()) {
+        printf("Array is missing buffered elements\n");
+        goto done;
+    }
+    printf("Added buffered elements\n");
+
+    /* Long names added after the array was freed must not reuse the freed arena. */
+    if (false == append_data_element(LONG_TEST_NAME, (void *)"World") ||
+        0 != strcmp(data_element_name(lookup_data_element(LONG_TEST_NAME)), LONG_TEST_NAME)) {
+        printf("Failed to add element with a long name after freeing the array\n");
+        goto done;
+    }
+
+    status = 0;
+
 done:
     free_data_array();
+    free(skipped_elements);
+    free(load_added);
+    free(load_name_ptrs);
+    free(load_names);
     return status;
 }
@@ -2,6 +2,9 @@
  * Copyright (c) 2020 Micah Snyder
  */
 
+#ifndef SAMPLE_TEST_H
+#define SAMPLE_TEST_H
+
 /* Standard libs */
 #include <stdbool.h>    /* For bool */
 #include <stdlib.h>     /* For malloc/free */
@@ -11,17 +14,9 @@
 /* 3rd-party Libs */
 #include <pthread.h>
 
-typedef struct {
-    char * name;
-    void * data;
-} named_data_t;
-
-/* We'll allocate the array of data pointers in increments of 100 */
-#define ARRAY_BLK_SZ 100
-
-extern pthread_mutex_t data_array_lock;
-extern named_data_t ** g_data_array;
-extern size_t g_data_array_size;     /* Size of array (in element) */
-extern size_t g_num_data_elements;   /* Number of element in array */
+/* Our headers */
+#include "data_array.h"
 
 bool append_data_element(const char * name, void * data);
+
+#endif /* SAMPLE_TEST_H */